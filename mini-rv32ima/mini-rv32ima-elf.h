@@ -0,0 +1,168 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// ELF32 RISC-V loader for mini-rv32ima.c, so -f can take what the linker made
+// without an objcopy to a flat binary first.  PT_LOAD segments go at their
+// physical addresses, the entry point comes from the header, and the symbol
+// table is kept so addresses can be turned back into names.
+
+#ifndef _MINI_RV32IMA_ELF_H
+#define _MINI_RV32IMA_ELF_H
+
+// Only what we need of <elf.h>, which Windows doesn't have.
+#define ELF_EM_RISCV   243
+#define ELF_PT_LOAD    1
+#define ELF_SHT_SYMTAB 2
+#define ELF_STT_FUNC   2
+
+struct ELFHeader
+{
+	uint8_t ident[16];
+	uint16_t type, machine;
+	uint32_t version, entry, phoff, shoff, flags;
+	uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct ELFProgramHeader
+{
+	uint32_t type, offset, vaddr, paddr, filesz, memsz, flags, align;
+};
+
+struct ELFSectionHeader
+{
+	uint32_t name, type, flags, addr, offset, size, link, info, addralign, entsize;
+};
+
+struct ELFSym
+{
+	uint32_t name, value, size;
+	uint8_t info, other;
+	uint16_t shndx;
+};
+
+struct ELFSymbol
+{
+	uint32_t addr, size;
+	const char * name;
+};
+
+// Symbols from the last ELF loaded, sorted by address.
+static struct ELFSymbol * elf_symbols;
+static int elf_symbol_count;
+static char * elf_symbol_names;
+
+static int IsELF( FILE * f )
+{
+	uint8_t ident[4];
+	int ret = fseek( f, 0, SEEK_SET ) == 0 && fread( ident, 4, 1, f ) == 1 && memcmp( ident, "\x7f" "ELF", 4 ) == 0;
+	fseek( f, 0, SEEK_SET );
+	return ret;
+}
+
+static int CompareELFSymbols( const void * a, const void * b )
+{
+	uint32_t x = ((const struct ELFSymbol *)a)->addr, y = ((const struct ELFSymbol *)b)->addr;
+	return ( x > y ) - ( x < y );
+}
+
+static void FreeELFSymbols()
+{
+	free( elf_symbols );
+	free( elf_symbol_names );
+	elf_symbols = 0;
+	elf_symbol_names = 0;
+	elf_symbol_count = 0;
+}
+
+// Keeps the named, defined symbols of the first SHT_SYMTAB.  Not having one is fine.
+static void LoadELFSymbols( FILE * f, struct ELFHeader * eh )
+{
+	struct ELFSectionHeader sh, strsh;
+	struct ELFSym * syms = 0;
+	int i, count = 0;
+
+	FreeELFSymbols();
+	for( i = 0; i < eh->shnum; i++ )
+	{
+		if( fseek( f, eh->shoff + i * eh->shentsize, SEEK_SET ) || fread( &sh, sizeof( sh ), 1, f ) != 1 ) return;
+		if( sh.type == ELF_SHT_SYMTAB ) break;
+	}
+	if( i == eh->shnum || sh.link >= eh->shnum || sh.entsize != sizeof( struct ELFSym ) ) return;
+	if( fseek( f, eh->shoff + sh.link * eh->shentsize, SEEK_SET ) || fread( &strsh, sizeof( strsh ), 1, f ) != 1 ) return;
+
+	count = sh.size / sizeof( struct ELFSym );
+	syms = malloc( sh.size );
+	elf_symbols = malloc( count * sizeof( struct ELFSymbol ) );
+	elf_symbol_names = malloc( strsh.size + 1 );
+	if( !syms || !elf_symbols || !elf_symbol_names ||
+		fseek( f, sh.offset, SEEK_SET ) || fread( syms, sizeof( struct ELFSym ), count, f ) != count ||
+		fseek( f, strsh.offset, SEEK_SET ) || fread( elf_symbol_names, strsh.size, 1, f ) != 1 )
+	{
+		free( syms );
+		FreeELFSymbols();
+		return;
+	}
+	elf_symbol_names[strsh.size] = 0;
+
+	for( i = 0; i < count; i++ )
+	{
+		if( !syms[i].shndx || !syms[i].name || syms[i].name >= strsh.size ) continue; // Undefined or unnamed.
+		elf_symbols[elf_symbol_count].addr = syms[i].value;
+		// Functions get their size, labels from assembly just run to the next symbol.
+		elf_symbols[elf_symbol_count].size = ( ( syms[i].info & 0xf ) == ELF_STT_FUNC ) ? syms[i].size : 0;
+		elf_symbols[elf_symbol_count].name = elf_symbol_names + syms[i].name;
+		elf_symbol_count++;
+	}
+	free( syms );
+	qsort( elf_symbols, elf_symbol_count, sizeof( struct ELFSymbol ), CompareELFSymbols );
+}
+
+// The symbol addr is in, or 0.  *ofs gets how far into it addr is.
+static const char * LookupELFSymbol( uint32_t addr, uint32_t * ofs )
+{
+	int lo = 0, hi = elf_symbol_count;
+	while( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if( elf_symbols[mid].addr <= addr ) lo = mid + 1;
+		else hi = mid;
+	}
+	if( lo == 0 ) return 0;
+	struct ELFSymbol * s = &elf_symbols[lo - 1];
+	if( s->size && addr - s->addr >= s->size ) return 0;
+	*ofs = addr - s->addr;
+	return s->name;
+}
+
+// Loads the segments into freshly cleared RAM.  BSS is left to the zero pages
+// already there.  Returns the entry point, or 0 on failure.
+static uint32_t LoadELF( FILE * f, uint8_t * image, uint32_t ramsize )
+{
+	struct ELFHeader eh;
+	struct ELFProgramHeader ph;
+	int i;
+
+	if( fread( &eh, sizeof( eh ), 1, f ) != 1 || eh.ident[4] != 1 /* ELFCLASS32 */ || eh.ident[5] != 1 /* Little endian */ ||
+		eh.machine != ELF_EM_RISCV || eh.phentsize != sizeof( ph ) )
+	{
+		fprintf( stderr, "Error: Not a 32-bit little endian RISC-V ELF\n" );
+		return 0;
+	}
+
+	for( i = 0; i < eh.phnum; i++ )
+	{
+		if( fseek( f, eh.phoff + i * sizeof( ph ), SEEK_SET ) || fread( &ph, sizeof( ph ), 1, f ) != 1 ) return 0;
+		if( ph.type != ELF_PT_LOAD || !ph.memsz ) continue;
+		uint32_t ofs = ph.paddr - MINIRV32_RAM_IMAGE_OFFSET;
+		if( ofs >= ramsize || ph.memsz > ramsize - ofs || ph.filesz > ph.memsz )
+		{
+			fprintf( stderr, "Error: ELF segment at %08x-%08x is outside of RAM\n", ph.paddr, ph.paddr + ph.memsz );
+			return 0;
+		}
+		if( ph.filesz && ( fseek( f, ph.offset, SEEK_SET ) || fread( image + ofs, ph.filesz, 1, f ) != 1 ) ) return 0;
+	}
+
+	LoadELFSymbols( f, &eh );
+	return eh.entry;
+}
+
+#endif
@@ -0,0 +1,172 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// Flattened device tree writer for mini-rv32ima.c, so the tree the guest boots
+// with is built from the command line at startup rather than patched into a
+// canned .dtb.  Nodes and properties go in the order they're added:
+//
+//	struct FDT fdt = { 0 };
+//	FDTBeginNode( &fdt, "" );
+//	FDTPropU32( &fdt, "#address-cells", 2 );
+//	FDTBeginNode( &fdt, "chosen" );
+//	FDTPropString( &fdt, "bootargs", "console=hvc0" );
+//	FDTEndNode( &fdt );
+//	FDTEndNode( &fdt );
+//	FDTWrite( &fdt, buffer ); // FDTSize( &fdt ) bytes.
+//	FDTFree( &fdt );
+
+#ifndef _MINI_RV32IMA_FDT_H
+#define _MINI_RV32IMA_FDT_H
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_END        9
+#define FDT_HEADER     40 // Bytes, followed by an empty memory reservation map.
+
+struct FDT
+{
+	uint8_t * structure; // Without the final FDT_END.
+	uint32_t structlen, structcap;
+	uint8_t * strings;
+	uint32_t stringlen, stringcap;
+	int failed; // Ran out of memory, don't use the result.
+};
+
+static void FDTPutU32( uint8_t * p, uint32_t v )
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+// Makes room for n more bytes at the end of a block, returns where they go.
+static uint8_t * FDTGrow( struct FDT * fdt, uint8_t ** buf, uint32_t * len, uint32_t * cap, uint32_t n )
+{
+	if( fdt->failed ) return 0;
+	if( *len + n > *cap )
+	{
+		uint32_t newcap = *cap ? *cap : 1024;
+		while( newcap < *len + n ) newcap *= 2;
+		uint8_t * p = realloc( *buf, newcap );
+		if( !p )
+		{
+			fdt->failed = 1;
+			return 0;
+		}
+		*buf = p;
+		*cap = newcap;
+	}
+	*len += n;
+	return *buf + *len - n;
+}
+
+static void FDTToken( struct FDT * fdt, uint32_t v )
+{
+	uint8_t * p = FDTGrow( fdt, &fdt->structure, &fdt->structlen, &fdt->structcap, 4 );
+	if( p ) FDTPutU32( p, v );
+}
+
+// Everything in the structure block is padded out to 4 bytes.
+static void FDTPadded( struct FDT * fdt, const void * data, uint32_t len )
+{
+	uint8_t * p = FDTGrow( fdt, &fdt->structure, &fdt->structlen, &fdt->structcap, ( len + 3 ) & ~3 );
+	if( !p ) return;
+	memcpy( p, data, len );
+	memset( p + len, 0, ( ( len + 3 ) & ~3 ) - len );
+}
+
+// Property names are stored once each, in the strings block.
+static uint32_t FDTString( struct FDT * fdt, const char * s )
+{
+	uint32_t ofs = 0, len = strlen( s ) + 1;
+	while( ofs < fdt->stringlen )
+	{
+		if( strcmp( (char*)fdt->strings + ofs, s ) == 0 ) return ofs;
+		ofs += strlen( (char*)fdt->strings + ofs ) + 1;
+	}
+	uint8_t * p = FDTGrow( fdt, &fdt->strings, &fdt->stringlen, &fdt->stringcap, len );
+	if( p ) memcpy( p, s, len );
+	return ofs;
+}
+
+static void FDTBeginNode( struct FDT * fdt, const char * name )
+{
+	FDTToken( fdt, FDT_BEGIN_NODE );
+	FDTPadded( fdt, name, strlen( name ) + 1 );
+}
+
+static void FDTEndNode( struct FDT * fdt )
+{
+	FDTToken( fdt, FDT_END_NODE );
+}
+
+static void FDTProp( struct FDT * fdt, const char * name, const void * data, uint32_t len )
+{
+	uint32_t nameofs = FDTString( fdt, name );
+	FDTToken( fdt, FDT_PROP );
+	FDTToken( fdt, len );
+	FDTToken( fdt, nameofs );
+	FDTPadded( fdt, data, len );
+}
+
+// A property with no value, like "ranges" or "interrupt-controller".
+static void FDTPropEmpty( struct FDT * fdt, const char * name )
+{
+	FDTProp( fdt, name, "", 0 );
+}
+
+static void FDTPropString( struct FDT * fdt, const char * name, const char * s )
+{
+	FDTProp( fdt, name, s, strlen( s ) + 1 );
+}
+
+// Up to 16 cells, like "reg" or "interrupts-extended".
+static void FDTPropCells( struct FDT * fdt, const char * name, const uint32_t * cells, int count )
+{
+	uint8_t be[64];
+	int i;
+	for( i = 0; i < count && i < 16; i++ )
+		FDTPutU32( be + i * 4, cells[i] );
+	FDTProp( fdt, name, be, i * 4 );
+}
+
+static void FDTPropU32( struct FDT * fdt, const char * name, uint32_t v )
+{
+	FDTPropCells( fdt, name, &v, 1 );
+}
+
+// Size of the finished blob, or 0 if it couldn't be built.
+static uint32_t FDTSize( struct FDT * fdt )
+{
+	if( fdt->failed ) return 0;
+	return FDT_HEADER + 16 + fdt->structlen + 4 + fdt->stringlen;
+}
+
+// out must have room for FDTSize() bytes.
+static void FDTWrite( struct FDT * fdt, uint8_t * out )
+{
+	uint32_t structofs = FDT_HEADER + 16;
+	uint32_t stringofs = structofs + fdt->structlen + 4;
+	FDTPutU32( out + 0, FDT_MAGIC );
+	FDTPutU32( out + 4, FDTSize( fdt ) );
+	FDTPutU32( out + 8, structofs );
+	FDTPutU32( out + 12, stringofs );
+	FDTPutU32( out + 16, FDT_HEADER ); // Memory reservation map.
+	FDTPutU32( out + 20, 17 ); // Version.
+	FDTPutU32( out + 24, 16 ); // Last compatible version.
+	FDTPutU32( out + 28, 0 ); // Boot CPU.
+	FDTPutU32( out + 32, fdt->stringlen );
+	FDTPutU32( out + 36, fdt->structlen + 4 );
+	memset( out + FDT_HEADER, 0, 16 ); // No reserved memory.
+	memcpy( out + structofs, fdt->structure, fdt->structlen );
+	FDTPutU32( out + structofs + fdt->structlen, FDT_END );
+	memcpy( out + stringofs, fdt->strings, fdt->stringlen );
+}
+
+static void FDTFree( struct FDT * fdt )
+{
+	free( fdt->structure );
+	free( fdt->strings );
+	memset( fdt, 0, sizeof( *fdt ) );
+}
+
+#endif
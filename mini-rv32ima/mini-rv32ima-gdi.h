@@ -0,0 +1,366 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// Windows frontend for mini-rv32ima.c.  The console is drawn straight onto the
+// top right third of the desktop with GDI, and keyboard input is taken while
+// the mouse hovers over it.  The emulator is paused while it isn't.
+
+#include <windows.h>
+#include <ctype.h>
+#include <winuser.h>
+
+static HDC g_hdc;
+static int g_line;
+static int g_column;
+static int g_char_width, g_char_height;
+static HFONT g_font;
+static POINT g_cursor;
+// Back-buffer DC and bitmap for fast redraw
+static HDC     g_memdc;
+static HBITMAP g_membmp;
+static int g_screen_width;
+static int g_screen_height;
+static int g_display_width;
+static int g_display_height;
+static int g_max_lines;
+// Overlay text buffer and dimensions
+static char *screen_buf = NULL;
+static int   g_max_cols = 0;
+// Buffered GetAsyncKeyState for keyboard input
+static int  g_kbPending = 0;
+static int  g_kbValue   = -1;
+
+static BOOL IsHover()
+{
+    POINT cursor_pos;
+    GetCursorPos(&cursor_pos);
+    if (cursor_pos.x > g_display_width - g_screen_width && cursor_pos.y < g_screen_height)
+        return TRUE;
+    else
+        return FALSE;
+}
+
+static void ConsoleInit()
+{
+    g_hdc = GetDC(NULL);
+    // Select the system OEM fixed-pitch font
+    g_font = CreateFont(12, 6, 0, 0, FW_DONTCARE, FALSE, FALSE, FALSE, DEFAULT_CHARSET, OUT_OUTLINE_PRECIS,
+                CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, VARIABLE_PITCH, TEXT("SimSun"));
+    SelectObject(g_hdc, g_font);
+    SetBkMode(g_hdc, TRANSPARENT);
+    SetTextColor(g_hdc, RGB(255,255,255));
+    // Clear entire screen to black
+    SetBkColor(g_hdc, RGB(0,0,0));
+    // Text background remains black
+    SetBkMode(g_hdc, OPAQUE);
+    // Query actual character cell size
+    {
+        TEXTMETRICA tm;
+        GetTextMetricsA(g_hdc, &tm);
+        g_char_width  = tm.tmAveCharWidth;
+        g_char_height = tm.tmHeight - tm.tmInternalLeading;
+    }
+    g_display_width  = GetDeviceCaps(g_hdc, HORZRES);
+    g_display_height = GetDeviceCaps(g_hdc, VERTRES);
+    g_screen_width = g_display_width / 3;
+    g_screen_height = g_display_height / 3;
+    g_max_lines     = g_screen_height / g_char_height;
+    // Initialize overlay buffer
+    g_max_cols  = g_screen_width / g_char_width;
+    screen_buf  = calloc(g_max_lines * g_max_cols, 1);
+    // Create back-buffer DC and bitmap
+    g_memdc  = CreateCompatibleDC(g_hdc);
+    g_membmp = CreateCompatibleBitmap(g_hdc, g_screen_width, g_screen_height);
+    SelectObject(g_memdc, g_membmp);
+    // Mirror text settings into back-buffer DC
+    SelectObject(g_memdc, g_font);
+    SetBkMode(g_memdc, OPAQUE);
+    SetTextColor(g_memdc, RGB(255,255,255));
+    SetBkColor(g_memdc, RGB(0,0,0));
+    // Clear back-buffer to black
+    PatBlt(g_memdc, 0, 0, g_screen_width, g_screen_height, BLACKNESS);
+    g_line = 0;
+    g_column = 0;
+}
+
+static void ConsoleShutdown()
+{
+    DeleteObject(g_font);
+    ReleaseDC(NULL, g_hdc);
+    // Destroy back-buffer
+    DeleteObject(g_membmp);
+    DeleteDC(g_memdc);
+    free(screen_buf);
+}
+
+static void ConsoleWrite(const char *s) {
+    static int ansi_state = 0; // 0=normal,1=seen ESC,2=in CSI
+    for (const char *p = s; *p; p++) {
+        unsigned char c = *p;
+        if (ansi_state == 0) {
+            if (c == '\x1b') { ansi_state = 1; continue; }
+        } else if (ansi_state == 1) {
+            if (c == '[') { ansi_state = 2; continue; }
+            ansi_state = 0;
+            // fallthrough to normal handling of c
+        } else if (ansi_state == 2) {
+            if (c >= 0x40 && c <= 0x7E) ansi_state = 0;
+            continue;
+        }
+        // Skip stray CSI sequences like "[1;30m" when ESC was lost
+        if (ansi_state == 0 && c == '[') {
+            const char *q = p + 1;
+            // scan digits and semicolons
+            while (*q && (isdigit((unsigned char)*q) || *q == ';')) {
+                q++;
+            }
+            // if we find a final byte (0x40–0x7E), skip the whole sequence
+            if (*q && ((unsigned char)*q >= 0x40 && (unsigned char)*q <= 0x7E)) {
+                p = q;
+                continue;
+            }
+        }
+        // Handle backspace
+        if (c == '\b') {
+            if (g_column > 0) {
+                g_column--;
+                // Clear the character cell in back-buffer
+                RECT r = {
+                    g_column * g_char_width,
+                    g_line   * g_char_height,
+                    (g_column + 1) * g_char_width,
+                    (g_line   + 1) * g_char_height
+                };
+                HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
+                FillRect(g_memdc, &r, hbr);
+                // Clear overlay buffer entry
+                screen_buf[g_line * g_max_cols + g_column] = 0;
+            }
+            continue;
+        }
+        // Normal character handling
+        if (c == '\r') {
+            g_column = 0;
+            continue;
+        } else if (c == '\n') {
+            g_line++;
+            g_column = 0;
+            if (g_line >= g_max_lines) {
+                int sh = g_char_height;
+                BitBlt(g_memdc, 0, 0, g_screen_width, g_screen_height - sh, g_memdc, 0, sh, SRCCOPY);
+                RECT r = {0, g_screen_height - sh, g_screen_width, g_screen_height};
+                HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
+                FillRect(g_memdc, &r, hbr);
+                g_line = g_max_lines - 1;
+            }
+        } else {
+            // Wrap on width overflow
+            int max_cols = g_screen_width / g_char_width;
+            if (g_column >= max_cols) {
+                g_line++;
+                g_column = 0;
+                if (g_line >= g_max_lines) {
+                    int sh = g_char_height;
+                    BitBlt(g_memdc, 0, 0, g_screen_width, g_screen_height - sh,
+                           g_memdc, 0, sh, SRCCOPY);
+                    RECT r = {0, g_screen_height - sh, g_screen_width, g_screen_height};
+                    HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
+                    FillRect(g_memdc, &r, hbr);
+                    g_line = g_max_lines - 1;
+                }
+            }
+            // Draw character
+            // Record character in overlay buffer
+            screen_buf[g_line * g_max_cols + g_column] = c;
+            TextOutA(g_memdc,
+                     g_column * g_char_width,
+                     g_line * g_char_height,
+                     (LPCSTR)&c, 1);
+            g_column++;
+        }
+    }
+}
+
+// Called between time slices, hold the emulator until the mouse is over us.
+static void ConsoleSliceDone()
+{
+    while (!IsHover())
+        Sleep(1);
+}
+
+// -H uses large pages, if we have SeLockMemoryPrivilege.
+static uint8_t * AllocateRAM()
+{
+    if (huge_pages) {
+        SIZE_T large = GetLargePageMinimum();
+        void *ram = large ? VirtualAlloc(NULL, (ram_amt + large - 1) & ~(large - 1),
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE) : NULL;
+        if (ram) {
+            ram_backing = "large pages";
+            return ram;
+        }
+    }
+    return malloc(ram_amt);
+}
+
+static int ClearRAM()
+{
+    memset(ram_image, 0, ram_amt);
+    return 0;
+}
+
+static int LoadRAMImage(FILE * f, long flen)
+{
+    ClearRAM();
+    return fread(ram_image, flen, 1, f) != 1;
+}
+
+// For gzip'd snapshots, in binary mode.
+#define popen(cmd, mode) _popen(cmd, (mode)[0] == 'w' ? "wb" : "rb")
+#define pclose _pclose
+
+static int ForkVMs(int count)
+{
+    fprintf(stderr, "Error: -F needs fork(), which Windows doesn't have\n");
+    return 0;
+}
+
+static int RunPool(int count, int threads, long long instct)
+{
+    fprintf(stderr, "Error: -P needs POSIX threads\n");
+    return -1;
+}
+
+// -D, mapped rather than read in.  Falls back to read only if the file isn't writable.
+static uint8_t * MapDiskImage(const char * fname, int copy_on_write, uint64_t * size, int * read_only)
+{
+    HANDLE file = CreateFileA(fname, GENERIC_READ | (copy_on_write ? 0 : GENERIC_WRITE), FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    *read_only = 0;
+    if (file == INVALID_HANDLE_VALUE && !copy_on_write) {
+        file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        *read_only = 1;
+    }
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER len;
+    HANDLE map = NULL;
+    if (GetFileSizeEx(file, &len) && len.QuadPart >= 512 && (SIZE_T)len.QuadPart == len.QuadPart)
+        map = CreateFileMappingA(file, NULL, (*read_only || copy_on_write) ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+    CloseHandle(file);
+    if (!map)
+        return NULL;
+    void *disk = MapViewOfFile(map, copy_on_write ? FILE_MAP_COPY : *read_only ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0);
+    CloseHandle(map);
+    if (disk)
+        *size = len.QuadPart;
+    return disk;
+}
+
+static int FlushDiskImage(struct MiniRV32IMAVirtio * dev)
+{
+    return !FlushViewOfFile(dev->disk, 0);
+}
+
+// -M, no TLB counters here, just time.
+static uint64_t benchmark_start;
+
+static void ReportBenchmark()
+{
+    fprintf(stderr, "Benchmark: %.3f s, %llu guest instructions, RAM on %s\n",
+        (GetTimeMicroseconds() - benchmark_start) / 1000000.0,
+        (unsigned long long)(((uint64_t)core->cycleh << 32) | core->cyclel), ram_backing);
+}
+
+static void StartBenchmark()
+{
+    if (benchmark_start)
+        return;
+    benchmark_start = GetTimeMicroseconds();
+    atexit(ReportBenchmark);
+}
+
+static void CaptureKeyboardInput()
+{
+    // No initialization needed for polling
+}
+
+static void ResetKeyboardInput()
+{
+    // No cleanup needed
+}
+
+// Sleeps for up to us microseconds, or until a key is pressed.
+static void MiniSleep( uint64_t us )
+{
+    // Idle sleep, drawing occurs in main loop via back-buffer blit
+        // Blit back-buffer to desktop DC each iteration
+    if (IsHover())
+        BitBlt(g_hdc, g_display_width - g_screen_width, 0, g_screen_width, g_screen_height,
+                g_memdc, 0, 0, SRCCOPY);
+
+    // Keyboard input is polled, so the best we can do is check it every millisecond.
+    uint64_t until = GetTimeMicroseconds() + us;
+    while (!IsKBHit() && GetTimeMicroseconds() < until)
+        Sleep(1);
+}
+
+static uint64_t GetTimeMicroseconds()
+{
+    static LARGE_INTEGER lpf;
+    LARGE_INTEGER li;
+    if (!lpf.QuadPart)
+        QueryPerformanceFrequency(&lpf);
+    QueryPerformanceCounter(&li);
+    return ((uint64_t)li.QuadPart * 1000000LL) / (uint64_t)lpf.QuadPart;
+}
+
+static int IsKBHit()
+{
+    if (g_kbPending)
+        return 1;
+    for (int vk = 8; vk < 256; vk++) {
+        // Skip pure SHIFT keys so they don't register as input
+        if (vk == VK_SHIFT || vk == VK_LSHIFT || vk == VK_RSHIFT)
+            continue;
+        if (GetAsyncKeyState(vk) & 1 && IsHover()) {
+            // Handle '-'/'_' key explicitly
+            if (vk == VK_OEM_MINUS) {
+                g_kbValue = (GetAsyncKeyState(VK_SHIFT) & 0x8000) ? '_' : '-';
+            } else {
+                BYTE ks[256];
+                GetKeyboardState(ks);
+                // Mark SHIFT in key state
+                if (GetAsyncKeyState(VK_SHIFT) & 0x8000)
+                    ks[VK_SHIFT] |= 0x80;
+                UINT scan = MapVirtualKeyA(vk, MAPVK_VK_TO_VSC);
+                WCHAR bufUni[4];
+                int len = ToUnicodeEx(
+                    vk, scan, ks, bufUni, 4, 0, GetKeyboardLayout(0)
+                );
+                if (len > 0) {
+                    g_kbValue = (int)bufUni[0];
+                } else {
+                    switch (vk) {
+                        case VK_LEFT:  g_kbValue = '\b'; break;
+                        case VK_RIGHT: g_kbValue = '\t'; break;
+                        case VK_UP:    g_kbValue = '\x1B'; break;
+                        case VK_DOWN:  g_kbValue = '\n'; break;
+                        default:       g_kbValue = -1; break;
+                    }
+                }
+            }
+            g_kbPending = 1;
+            return 1;
+        }
+        // Redraw overlay buffer to desktop DC each iteration
+    }
+    return 0;
+}
+
+static int ReadKBByte()
+{
+    if (!g_kbPending)
+        return -1;
+    int c = g_kbValue;
+    g_kbPending = 0;
+    return c;
+}
@@ -0,0 +1,373 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+#ifndef _MINI_RV32IMA_JIT_H
+#define _MINI_RV32IMA_JIT_H
+
+/**
+	x86-64 backend for mini-rv32ima.h, enabled with MINIRV32_JIT.  Don't
+	include this directly, mini-rv32ima.h does that for you.
+
+	Hot blocks from the block cache get compiled to native code.  Guest
+	registers stay in MiniRV32IMAState.regs, a value just written is reused
+	straight out of a host register by the next instruction.  Native code
+	returns to MiniRV32IMAStep at the end of every block, and bails out to it
+	just before anything it doesn't handle: MMIO, faults, stores into code,
+	CSRs, SYSTEM and RV32A.  So return codes, traps and cycle counts are the
+	same as without the JIT.
+
+	Notes:
+		* MINIRV32_POSTEXEC is not called for natively run instructions.
+		* MINI_RV32_RAM_SIZE is baked into native code, flush the decode
+		  cache if it ever changes.
+		* Default MINIRV32_CUSTOM_INTERNALS and memory bus only.
+		* With MINIRV32_DIRTY_PAGES, the address of MINIRV32_DIRTY_BITMAP is
+		  baked in too.
+		* Loads and stores through a register that nothing earlier in the
+		  block writes are bounds checked once, on entry to the block, over
+		  the whole span of offsets used.  If that fails the block exits
+		  before doing anything and the interpreter takes over.
+*/
+
+#if !defined( __x86_64__ ) || defined( _WIN32 )
+	#error MINIRV32_JIT is only supported on x86-64 POSIX hosts.
+#endif
+
+#include <sys/mman.h>
+
+#define MINIRV32_JIT_E1( b ) ( *(p++) = (uint8_t)(b) )
+#define MINIRV32_JIT_E4( v ) { uint32_t ev = (v); *(p++) = ev; *(p++) = ev>>8; *(p++) = ev>>16; *(p++) = ev>>24; }
+#define MINIRV32_JIT_E8( v ) { uint64_t eq = (v); MINIRV32_JIT_E4( (uint32_t)eq ); MINIRV32_JIT_E4( (uint32_t)( eq>>32 ) ); }
+
+// Register use: rdi = regs, rsi = image, r11 = where to put the next pc.
+// eax and ecx are scratch, eax may hold the guest register in "cached".
+#define MINIRV32_JIT_LOAD_EAX( r ) \
+	if( (r) == 0 ) { MINIRV32_JIT_E1( 0x31 ); MINIRV32_JIT_E1( 0xc0 ); } /* xor eax, eax */ \
+	else if( (r) != cached ) { MINIRV32_JIT_E1( 0x8b ); MINIRV32_JIT_E1( 0x47 ); MINIRV32_JIT_E1( (r)*4 ); } /* mov eax, [rdi+r*4] */
+#define MINIRV32_JIT_LOAD_ECX( r ) \
+	if( (r) != 0 && (r) == cached ) { MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0xc1 ); } /* mov ecx, eax */ \
+	else { MINIRV32_JIT_E1( 0x8b ); MINIRV32_JIT_E1( 0x4f ); MINIRV32_JIT_E1( (r)*4 ); } /* mov ecx, [rdi+r*4] */
+#define MINIRV32_JIT_STORE_EAX( r ) \
+	if( r ) { MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0x47 ); MINIRV32_JIT_E1( (r)*4 ); cached = (r); } /* mov [rdi+r*4], eax */ \
+	else cached = -1;
+#define MINIRV32_JIT_EXIT( pcnext, done ) \
+	{ \
+		MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0xc7 ); MINIRV32_JIT_E1( 0x03 ); MINIRV32_JIT_E4( pcnext ); /* mov dword [r11], pcnext */ \
+		MINIRV32_JIT_E1( 0xb8 ); MINIRV32_JIT_E4( done ); /* mov eax, done */ \
+		MINIRV32_JIT_E1( 0xc3 ); /* ret */ \
+	}
+#ifndef MINIRV32_JIT_BASES
+	#define MINIRV32_JIT_BASES 4 // Most base registers checked on entry to a block.
+#endif
+
+#define MINIRV32_JIT_JCC8( cc ) ( MINIRV32_JIT_E1( cc ), MINIRV32_JIT_E1( 0 ), p - 1 )
+#define MINIRV32_JIT_PATCH8( at ) { *(at) = p - (at) - 1; }
+
+static void MiniRV32IMAJITReset( struct MiniRV32IMADecodeCache * cache )
+{
+	if( !cache->jitbuf )
+	{
+		void * m = mmap( 0, MINIRV32_JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		cache->jitbuf = ( m == MAP_FAILED ) ? 0 : (uint8_t*)m;
+	}
+	if( cache->jitused )
+		cache->epoch++; // Every block that pointed into the buffer goes away.
+	cache->jitused = 0;
+}
+
+static void MiniRV32IMAJITCompile( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMABlock * blk )
+{
+	if( !cache->jitbuf || cache->jitused + MINIRV32_JIT_BLOCK_BYTES > MINIRV32_JIT_SIZE )
+	{
+		// This block is stale after a reset too, it'll be compiled again once it gets hot.
+		MiniRV32IMAJITReset( cache );
+		blk->hits = 0;
+		return;
+	}
+
+	uint8_t * start = cache->jitbuf + cache->jitused;
+	uint8_t * p = start;
+	uint8_t * exitpatch[MINIRV32_BLOCK_MAX*3+MINIRV32_JIT_BASES];
+	uint32_t exitno[MINIRV32_BLOCK_MAX*3+MINIRV32_JIT_BASES];
+	int exits = 0;
+	int cached = -1;
+	uint32_t blockpc = blk->tag & ~1;
+	uint32_t len = blk->len;
+	uint32_t i;
+
+	// Find the loads and stores whose base register still holds its value
+	// from block entry, and the span of offsets used with each of those.
+	uint8_t covered[MINIRV32_BLOCK_MAX] = { 0 };
+	uint8_t basereg[MINIRV32_JIT_BASES];
+	int32_t baselo[MINIRV32_JIT_BASES], basehi[MINIRV32_JIT_BASES];
+	uint32_t written = 0;
+	int bases = 0, b;
+	for( i = 0; i < len; i++ )
+	{
+		const struct MiniRV32IMADecodedInsn * d = &blk->insn[i];
+		uint32_t op = d->op;
+#ifdef MINIRV32_FUSE
+		if( op >= MINIRV32_OP_LUI_ADDI ) op = MiniRV32IMAFusedFirst[op - MINIRV32_OP_LUI_ADDI];
+#endif
+		if( op >= MINIRV32_OP_LB && op <= MINIRV32_OP_SW && d->rs1 && !( written & ( 1u << d->rs1 ) ) )
+		{
+			for( b = 0; b < bases && basereg[b] != d->rs1; b++ );
+			if( b == bases && bases < MINIRV32_JIT_BASES )
+			{
+				basereg[b] = d->rs1;
+				baselo[b] = basehi[b] = d->imm;
+				bases++;
+			}
+			if( b < bases )
+			{
+				int32_t lo = ( d->imm < baselo[b] ) ? d->imm : baselo[b];
+				int32_t hi = ( d->imm > basehi[b] ) ? d->imm : basehi[b];
+				if( (uint32_t)( hi - lo ) < MINI_RV32_RAM_SIZE - 3 )
+				{
+					baselo[b] = lo;
+					basehi[b] = hi;
+					covered[i] = 1;
+				}
+			}
+		}
+		written |= 1u << d->rd;
+	}
+
+	MINIRV32_JIT_E1( 0x49 ); MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0xd3 ); // mov r11, rdx
+
+	// Every offset from each base has to land in RAM, or none of the block runs.
+	for( b = 0; b < bases; b++ )
+	{
+		MINIRV32_JIT_E1( 0x8b ); MINIRV32_JIT_E1( 0x47 ); MINIRV32_JIT_E1( basereg[b]*4 ); // mov eax, [rdi+base*4]
+		MINIRV32_JIT_E1( 0x05 ); MINIRV32_JIT_E4( baselo[b] - MINIRV32_RAM_IMAGE_OFFSET ); // add eax, lo - MINIRV32_RAM_IMAGE_OFFSET
+		MINIRV32_JIT_E1( 0x3d ); MINIRV32_JIT_E4( MINI_RV32_RAM_SIZE - 3 - ( basehi[b] - baselo[b] ) ); // cmp eax, MINI_RV32_RAM_SIZE - 3 - ( hi - lo )
+		MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0x83 ); MINIRV32_JIT_E4( 0 ); // jae exit
+		exitpatch[exits] = p - 4; exitno[exits++] = 0;
+	}
+
+	for( i = 0; i < len; i++ )
+	{
+		const struct MiniRV32IMADecodedInsn * d = &blk->insn[i];
+		uint32_t pc = blockpc + i * 4;
+		uint32_t op = d->op;
+#ifdef MINIRV32_FUSE
+		if( op >= MINIRV32_OP_LUI_ADDI ) op = MiniRV32IMAFusedFirst[op - MINIRV32_OP_LUI_ADDI]; // Pairs are compiled one at a time.
+#endif
+		int rd = d->rd;
+
+		// Instructions without side effects can be dropped if they write to x0.
+		if( rd == 0 && ( ( op >= MINIRV32_OP_ADDI && op <= MINIRV32_OP_REMU ) || op == MINIRV32_OP_LUI || op == MINIRV32_OP_AUIPC ) )
+			continue;
+
+		switch( op )
+		{
+		case MINIRV32_OP_LUI:
+		case MINIRV32_OP_AUIPC:
+			MINIRV32_JIT_E1( 0xb8 ); MINIRV32_JIT_E4( d->imm + ( ( op == MINIRV32_OP_AUIPC ) ? pc : 0 ) ); // mov eax, imm
+			MINIRV32_JIT_STORE_EAX( rd );
+			break;
+		case MINIRV32_OP_ADDI: case MINIRV32_OP_XORI: case MINIRV32_OP_ORI: case MINIRV32_OP_ANDI:
+		{
+			static const uint8_t aluimm[4] = { 0x05, 0x35, 0x0d, 0x25 }; // add, xor, or, and eax, imm32
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			MINIRV32_JIT_E1( aluimm[ ( op == MINIRV32_OP_ADDI ) ? 0 : ( op - MINIRV32_OP_XORI + 1 ) ] ); MINIRV32_JIT_E4( d->imm );
+			MINIRV32_JIT_STORE_EAX( rd );
+			break;
+		}
+		case MINIRV32_OP_SLTI: case MINIRV32_OP_SLTIU:
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			MINIRV32_JIT_E1( 0x3d ); MINIRV32_JIT_E4( d->imm ); // cmp eax, imm32
+			MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( ( op == MINIRV32_OP_SLTI ) ? 0x9c : 0x92 ); MINIRV32_JIT_E1( 0xc0 ); // setl / setb al
+			MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xb6 ); MINIRV32_JIT_E1( 0xc0 ); // movzx eax, al
+			MINIRV32_JIT_STORE_EAX( rd );
+			break;
+		case MINIRV32_OP_SLLI: case MINIRV32_OP_SRLI: case MINIRV32_OP_SRAI:
+		{
+			static const uint8_t shimm[3] = { 0xe0, 0xe8, 0xf8 }; // shl, shr, sar eax, imm8
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( shimm[op - MINIRV32_OP_SLLI] ); MINIRV32_JIT_E1( d->imm );
+			MINIRV32_JIT_STORE_EAX( rd );
+			break;
+		}
+		case MINIRV32_OP_ADD: case MINIRV32_OP_SUB: case MINIRV32_OP_XOR: case MINIRV32_OP_OR: case MINIRV32_OP_AND:
+		case MINIRV32_OP_SLT: case MINIRV32_OP_SLTU: case MINIRV32_OP_SLL: case MINIRV32_OP_SRL: case MINIRV32_OP_SRA:
+		case MINIRV32_OP_MUL: case MINIRV32_OP_MULH: case MINIRV32_OP_MULHSU: case MINIRV32_OP_MULHU:
+		case MINIRV32_OP_DIV: case MINIRV32_OP_DIVU: case MINIRV32_OP_REM: case MINIRV32_OP_REMU:
+#ifdef CUSTOM_MULH
+			if( op >= MINIRV32_OP_MULH && op <= MINIRV32_OP_MULHU ) goto unsupported;
+#endif
+			MINIRV32_JIT_LOAD_ECX( d->rs2 );
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			switch( op )
+			{
+			case MINIRV32_OP_ADD: MINIRV32_JIT_E1( 0x01 ); MINIRV32_JIT_E1( 0xc8 ); break; // add eax, ecx
+			case MINIRV32_OP_SUB: MINIRV32_JIT_E1( 0x29 ); MINIRV32_JIT_E1( 0xc8 ); break; // sub eax, ecx
+			case MINIRV32_OP_XOR: MINIRV32_JIT_E1( 0x31 ); MINIRV32_JIT_E1( 0xc8 ); break; // xor eax, ecx
+			case MINIRV32_OP_OR:  MINIRV32_JIT_E1( 0x09 ); MINIRV32_JIT_E1( 0xc8 ); break; // or eax, ecx
+			case MINIRV32_OP_AND: MINIRV32_JIT_E1( 0x21 ); MINIRV32_JIT_E1( 0xc8 ); break; // and eax, ecx
+			case MINIRV32_OP_SLT: case MINIRV32_OP_SLTU:
+				MINIRV32_JIT_E1( 0x39 ); MINIRV32_JIT_E1( 0xc8 ); // cmp eax, ecx
+				MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( ( op == MINIRV32_OP_SLT ) ? 0x9c : 0x92 ); MINIRV32_JIT_E1( 0xc0 ); // setl / setb al
+				MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xb6 ); MINIRV32_JIT_E1( 0xc0 ); // movzx eax, al
+				break;
+			case MINIRV32_OP_SLL: MINIRV32_JIT_E1( 0xd3 ); MINIRV32_JIT_E1( 0xe0 ); break; // shl eax, cl (x86 masks the count like RV32 does)
+			case MINIRV32_OP_SRL: MINIRV32_JIT_E1( 0xd3 ); MINIRV32_JIT_E1( 0xe8 ); break; // shr eax, cl
+			case MINIRV32_OP_SRA: MINIRV32_JIT_E1( 0xd3 ); MINIRV32_JIT_E1( 0xf8 ); break; // sar eax, cl
+			case MINIRV32_OP_MUL: MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xaf ); MINIRV32_JIT_E1( 0xc1 ); break; // imul eax, ecx
+			case MINIRV32_OP_MULH: case MINIRV32_OP_MULHSU: case MINIRV32_OP_MULHU:
+				// Do it as a 64-bit multiply, 32-bit loads already zero-extend.
+				if( op != MINIRV32_OP_MULHU ) { MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( 0x63 ); MINIRV32_JIT_E1( 0xc0 ); } // movsxd rax, eax
+				if( op == MINIRV32_OP_MULH ) { MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( 0x63 ); MINIRV32_JIT_E1( 0xc9 ); } // movsxd rcx, ecx
+				MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xaf ); MINIRV32_JIT_E1( 0xc1 ); // imul rax, rcx
+				MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( 0xe8 ); MINIRV32_JIT_E1( 0x20 ); // shr rax, 32
+				break;
+			default: // Division, avoiding the x86 divide-by-zero and overflow faults.
+			{
+				int is_signed = ( op == MINIRV32_OP_DIV || op == MINIRV32_OP_REM );
+				int is_rem = ( op == MINIRV32_OP_REM || op == MINIRV32_OP_REMU );
+				uint8_t * jzero, * jok1 = 0, * jok2 = 0, * jdone1 = 0, * jdone2;
+				MINIRV32_JIT_E1( 0x85 ); MINIRV32_JIT_E1( 0xc9 ); // test ecx, ecx
+				jzero = MINIRV32_JIT_JCC8( 0x74 ); // jz
+				if( is_signed )
+				{
+					MINIRV32_JIT_E1( 0x83 ); MINIRV32_JIT_E1( 0xf9 ); MINIRV32_JIT_E1( 0xff ); // cmp ecx, -1
+					jok1 = MINIRV32_JIT_JCC8( 0x75 ); // jne
+					MINIRV32_JIT_E1( 0x3d ); MINIRV32_JIT_E4( 0x80000000 ); // cmp eax, INT32_MIN
+					jok2 = MINIRV32_JIT_JCC8( 0x75 ); // jne
+					if( is_rem ) { MINIRV32_JIT_E1( 0x31 ); MINIRV32_JIT_E1( 0xc0 ); } // xor eax, eax (DIV keeps INT32_MIN)
+					jdone1 = MINIRV32_JIT_JCC8( 0xeb ); // jmp
+					MINIRV32_JIT_PATCH8( jok1 );
+					MINIRV32_JIT_PATCH8( jok2 );
+					MINIRV32_JIT_E1( 0x99 ); // cdq
+					MINIRV32_JIT_E1( 0xf7 ); MINIRV32_JIT_E1( 0xf9 ); // idiv ecx
+				}
+				else
+				{
+					MINIRV32_JIT_E1( 0x31 ); MINIRV32_JIT_E1( 0xd2 ); // xor edx, edx
+					MINIRV32_JIT_E1( 0xf7 ); MINIRV32_JIT_E1( 0xf1 ); // div ecx
+				}
+				if( is_rem ) { MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0xd0 ); } // mov eax, edx
+				jdone2 = MINIRV32_JIT_JCC8( 0xeb ); // jmp
+				MINIRV32_JIT_PATCH8( jzero );
+				if( !is_rem ) { MINIRV32_JIT_E1( 0xb8 ); MINIRV32_JIT_E4( 0xffffffff ); } // mov eax, -1 (REM keeps rs1)
+				if( jdone1 ) MINIRV32_JIT_PATCH8( jdone1 );
+				MINIRV32_JIT_PATCH8( jdone2 );
+				break;
+			}
+			}
+			MINIRV32_JIT_STORE_EAX( rd );
+			break;
+		case MINIRV32_OP_LB: case MINIRV32_OP_LH: case MINIRV32_OP_LW: case MINIRV32_OP_LBU: case MINIRV32_OP_LHU:
+		case MINIRV32_OP_SB: case MINIRV32_OP_SH: case MINIRV32_OP_SW:
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			cached = -1;
+			MINIRV32_JIT_E1( 0x05 ); MINIRV32_JIT_E4( d->imm - MINIRV32_RAM_IMAGE_OFFSET ); // add eax, imm - MINIRV32_RAM_IMAGE_OFFSET
+			if( !covered[i] )
+			{
+				MINIRV32_JIT_E1( 0x3d ); MINIRV32_JIT_E4( MINI_RV32_RAM_SIZE - 3 ); // cmp eax, MINI_RV32_RAM_SIZE - 3
+				MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0x83 ); MINIRV32_JIT_E4( 0 ); // jae exit (MMIO or fault)
+				exitpatch[exits] = p - 4; exitno[exits++] = i;
+			}
+			if( op <= MINIRV32_OP_LHU )
+			{
+				static const uint8_t loadop[5][2] = { { 0x0f, 0xbe }, { 0x0f, 0xbf }, { 0x00, 0x8b }, { 0x0f, 0xb6 }, { 0x0f, 0xb7 } };
+				if( loadop[op - MINIRV32_OP_LB][0] ) MINIRV32_JIT_E1( loadop[op - MINIRV32_OP_LB][0] );
+				MINIRV32_JIT_E1( loadop[op - MINIRV32_OP_LB][1] ); MINIRV32_JIT_E1( 0x04 ); MINIRV32_JIT_E1( 0x06 ); // mov/movsx/movzx eax, [rsi+rax]
+				MINIRV32_JIT_STORE_EAX( rd );
+			}
+			else
+			{
+				// Let the interpreter do stores into pages with code, so it can drop the blocks.
+				MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0xc1 ); // mov ecx, eax
+				MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( 0xe9 ); MINIRV32_JIT_E1( MINIRV32_PREDECODE_PAGE_SHIFT ); // shr ecx, MINIRV32_PREDECODE_PAGE_SHIFT
+				MINIRV32_JIT_E1( 0x81 ); MINIRV32_JIT_E1( 0xe1 ); MINIRV32_JIT_E4( MINIRV32_PREDECODE_PAGES - 1 ); // and ecx, MINIRV32_PREDECODE_PAGES - 1
+				MINIRV32_JIT_E1( 0x49 ); MINIRV32_JIT_E1( 0xba ); MINIRV32_JIT_E8( (uintptr_t)cache->codepages ); // mov r10, codepages
+				MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xa3 ); MINIRV32_JIT_E1( 0x0a ); // bt [r10], ecx
+				MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0x82 ); MINIRV32_JIT_E4( 0 ); // jc exit
+				exitpatch[exits] = p - 4; exitno[exits++] = i;
+				if( op != MINIRV32_OP_SB )
+				{
+					// Misaligned stores can straddle into a code page.
+					MINIRV32_JIT_E1( 0x8d ); MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( ( op == MINIRV32_OP_SH ) ? 1 : 3 ); // lea ecx, [rax+len-1]
+					MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( 0xe9 ); MINIRV32_JIT_E1( MINIRV32_PREDECODE_PAGE_SHIFT ); // shr ecx, MINIRV32_PREDECODE_PAGE_SHIFT
+					MINIRV32_JIT_E1( 0x81 ); MINIRV32_JIT_E1( 0xe1 ); MINIRV32_JIT_E4( MINIRV32_PREDECODE_PAGES - 1 ); // and ecx, MINIRV32_PREDECODE_PAGES - 1
+					MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xa3 ); MINIRV32_JIT_E1( 0x0a ); // bt [r10], ecx
+					MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0x82 ); MINIRV32_JIT_E4( 0 ); // jc exit
+					exitpatch[exits] = p - 4; exitno[exits++] = i;
+				}
+#ifdef MINIRV32_DIRTY_PAGES
+				MINIRV32_JIT_E1( 0x49 ); MINIRV32_JIT_E1( 0xba ); MINIRV32_JIT_E8( (uintptr_t)MINIRV32_DIRTY_BITMAP ); // mov r10, dirty bitmap
+				MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0xc1 ); // mov ecx, eax
+				MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( 0xe9 ); MINIRV32_JIT_E1( MINIRV32_DIRTY_PAGE_SHIFT ); // shr ecx, MINIRV32_DIRTY_PAGE_SHIFT
+				MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xab ); MINIRV32_JIT_E1( 0x0a ); // bts [r10], ecx
+				if( op != MINIRV32_OP_SB )
+				{
+					// Misaligned stores can straddle two pages.
+					MINIRV32_JIT_E1( 0x8d ); MINIRV32_JIT_E1( 0x48 ); MINIRV32_JIT_E1( ( op == MINIRV32_OP_SH ) ? 1 : 3 ); // lea ecx, [rax+len-1]
+					MINIRV32_JIT_E1( 0xc1 ); MINIRV32_JIT_E1( 0xe9 ); MINIRV32_JIT_E1( MINIRV32_DIRTY_PAGE_SHIFT ); // shr ecx, MINIRV32_DIRTY_PAGE_SHIFT
+					MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0x0f ); MINIRV32_JIT_E1( 0xab ); MINIRV32_JIT_E1( 0x0a ); // bts [r10], ecx
+				}
+#endif
+				MINIRV32_JIT_E1( 0x8b ); MINIRV32_JIT_E1( 0x4f ); MINIRV32_JIT_E1( d->rs2 * 4 ); // mov ecx, [rdi+rs2*4]
+				if( op == MINIRV32_OP_SH ) MINIRV32_JIT_E1( 0x66 );
+				MINIRV32_JIT_E1( ( op == MINIRV32_OP_SB ) ? 0x88 : 0x89 ); MINIRV32_JIT_E1( 0x0c ); MINIRV32_JIT_E1( 0x06 ); // mov [rsi+rax], ecx/cx/cl
+			}
+			break;
+		case MINIRV32_OP_FENCE:
+			break;
+		case MINIRV32_OP_JAL:
+			if( rd ) { MINIRV32_JIT_E1( 0xb8 ); MINIRV32_JIT_E4( pc + 4 ); MINIRV32_JIT_STORE_EAX( rd ); }
+			MINIRV32_JIT_EXIT( pc + d->imm, len );
+			break;
+		case MINIRV32_OP_JALR:
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			MINIRV32_JIT_E1( 0x05 ); MINIRV32_JIT_E4( d->imm ); // add eax, imm
+			MINIRV32_JIT_E1( 0x83 ); MINIRV32_JIT_E1( 0xe0 ); MINIRV32_JIT_E1( 0xfe ); // and eax, ~1
+			MINIRV32_JIT_E1( 0x41 ); MINIRV32_JIT_E1( 0x89 ); MINIRV32_JIT_E1( 0x03 ); // mov [r11], eax
+			if( rd ) { MINIRV32_JIT_E1( 0xc7 ); MINIRV32_JIT_E1( 0x47 ); MINIRV32_JIT_E1( rd*4 ); MINIRV32_JIT_E4( pc + 4 ); } // mov dword [rdi+rd*4], pc + 4
+			MINIRV32_JIT_E1( 0xb8 ); MINIRV32_JIT_E4( len ); // mov eax, len
+			MINIRV32_JIT_E1( 0xc3 ); // ret
+			break;
+		case MINIRV32_OP_BEQ: case MINIRV32_OP_BNE: case MINIRV32_OP_BLT: case MINIRV32_OP_BGE: case MINIRV32_OP_BLTU: case MINIRV32_OP_BGEU:
+		{
+			static const uint8_t jcc[6] = { 0x74, 0x75, 0x7c, 0x7d, 0x72, 0x73 }; // je, jne, jl, jge, jb, jae
+			MINIRV32_JIT_LOAD_ECX( d->rs2 );
+			MINIRV32_JIT_LOAD_EAX( d->rs1 );
+			MINIRV32_JIT_E1( 0x39 ); MINIRV32_JIT_E1( 0xc8 ); // cmp eax, ecx
+			uint8_t * jtaken = MINIRV32_JIT_JCC8( jcc[op - MINIRV32_OP_BEQ] );
+			MINIRV32_JIT_EXIT( pc + 4, len );
+			MINIRV32_JIT_PATCH8( jtaken );
+			MINIRV32_JIT_EXIT( pc + d->imm, len );
+			break;
+		}
+		default:
+			goto unsupported;
+		}
+	}
+
+	// Ran off the end of a block that doesn't end in a jump.
+	if( i == len && ( blk->insn[len-1].op < MINIRV32_OP_JAL || blk->insn[len-1].op > MINIRV32_OP_BGEU ) )
+		MINIRV32_JIT_EXIT( blockpc + len * 4, len );
+
+	if( 0 )
+	{
+unsupported:
+		MINIRV32_JIT_EXIT( blockpc + i * 4, i );
+	}
+
+	// Bail-out stubs, for letting the interpreter redo instruction i.
+	int e;
+	for( e = 0; e < exits; e++ )
+	{
+		uint8_t * at = exitpatch[e];
+		uint32_t rel = p - ( at + 4 );
+		at[0] = rel; at[1] = rel>>8; at[2] = rel>>16; at[3] = rel>>24;
+		// Exits from the same instruction share one stub.
+		if( e + 1 == exits || exitno[e + 1] != exitno[e] )
+			MINIRV32_JIT_EXIT( blockpc + exitno[e] * 4, exitno[e] );
+	}
+
+	cache->jitused += ( p - start + 15 ) & ~15;
+	blk->native = (MiniRV32IMANativeBlock)start;
+}
+
+#endif
@@ -0,0 +1,400 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// Runs lots of MiniRV32IMAVMs on a fixed number of threads, for when total
+// throughput matters more than how fast any one guest goes, i.e. running a
+// pile of tests at once.  Each worker thread has its own queue of VMs and
+// takes turns running them, and when its queue is empty it steals from the
+// others'.  A VM waiting in WFI is parked until its timer is due or it's
+// given input, so idle guests cost nothing.  POSIX threads only.
+//
+//	struct MiniRV32IMAPool * pool = MiniRV32IMAPoolCreate( threads, count, Output, Done );
+//	for( ... )
+//		MiniRV32IMAPoolAdd( pool, vm, budget, user ); // Started with MiniRV32IMAVMStart().
+//	MiniRV32IMAPoolRun( pool ); // Until every VM is done.
+//	MiniRV32IMAPoolDestroy( pool );
+//
+// Include it after mini-rv32ima-vm.h.
+
+#ifndef _MINI_RV32IMA_POOL_H
+#define _MINI_RV32IMA_POOL_H
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#define MINIRV32_POOL_QUANTUM (1<<22) // Instructions a VM gets before the next one in the queue has a turn.
+#define MINIRV32_POOL_MAX_WAIT 10000  // Longest an idle worker waits before looking for work again, in microseconds.
+
+// Both are called from the worker threads, but never for the same VM at the
+// same time.  why is a MiniRV32IMAVMExit, MINIRV32_VM_OK if the VM used up its
+// budget.  A VM is done after MINIRV32_VM_POWEROFF, _REBOOT or _FAULT too.
+typedef void (*MiniRV32IMAPoolOutput)( void * user, const uint8_t * buf, uint32_t len );
+typedef void (*MiniRV32IMAPoolDone)( void * user, struct MiniRV32IMAVM * vm, int why );
+
+struct MiniRV32IMAPoolSlot
+{
+	struct MiniRV32IMAVM * vm;
+	void * user;
+	uint64_t budget; // Instructions left.
+	uint64_t wake;   // While parked, when to run it again.
+	int parked;      // Where it is in the sleepers heap, or -1.
+	uint8_t input[MINIRV32_VM_INPUT_SIZE]; // From MiniRV32IMAPoolInput(), for its next turn.
+	uint32_t input_len;
+};
+
+struct MiniRV32IMAPoolQueue
+{
+	struct MiniRV32IMAPool * pool;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct MiniRV32IMAPoolSlot ** slots; // Ring with room for every VM.
+	uint32_t head, count;
+};
+
+struct MiniRV32IMAPool
+{
+	int threads, capacity, count;
+	struct MiniRV32IMAPoolSlot * slots;
+	struct MiniRV32IMAPoolQueue * queues; // One per worker.
+	MiniRV32IMAPoolOutput output;
+	MiniRV32IMAPoolDone done;
+
+	// The rest is under lock.
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	struct MiniRV32IMAPoolSlot ** sleepers; // Parked VMs, a heap on wake.
+	int sleeping;
+	int idle; // Workers waiting on wakeup.
+	int live; // VMs that aren't done.
+	int stop; // MiniRV32IMAPoolRun() couldn't start every worker, the rest give up.
+	uint64_t instructions; // How many all the VMs ran.
+};
+
+// Returns 0 if out of memory.
+MINIRV32_DECORATE struct MiniRV32IMAPool * MiniRV32IMAPoolCreate( int threads, int capacity, MiniRV32IMAPoolOutput output, MiniRV32IMAPoolDone done );
+
+// Doesn't destroy the VMs.
+MINIRV32_DECORATE void MiniRV32IMAPoolDestroy( struct MiniRV32IMAPool * pool );
+
+// Before MiniRV32IMAPoolRun(), returns the VM's id or -1 if the pool is full.
+MINIRV32_DECORATE int MiniRV32IMAPoolAdd( struct MiniRV32IMAPool * pool, struct MiniRV32IMAVM * vm, uint64_t budget, void * user );
+
+// Runs every VM until it's done.  Returns nonzero if the threads couldn't be started.
+MINIRV32_DECORATE int MiniRV32IMAPoolRun( struct MiniRV32IMAPool * pool );
+
+// Queues input for VM id, waking it if it's parked.  Can be called from any
+// thread while the pool runs.  Returns how many of the len bytes fit.
+MINIRV32_DECORATE uint32_t MiniRV32IMAPoolInput( struct MiniRV32IMAPool * pool, int id, const uint8_t * buf, uint32_t len );
+
+#ifdef MINIRV32_VM_IMPLEMENTATION
+
+static uint64_t MiniRV32IMAPoolTime()
+{
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
+}
+
+MINIRV32_DECORATE struct MiniRV32IMAPool * MiniRV32IMAPoolCreate( int threads, int capacity, MiniRV32IMAPoolOutput output, MiniRV32IMAPoolDone done )
+{
+	int i;
+	if( threads < 1 || capacity < 1 ) return 0;
+	struct MiniRV32IMAPool * pool = calloc( 1, sizeof( struct MiniRV32IMAPool ) );
+	if( !pool ) return 0;
+	pool->threads = threads;
+	pool->capacity = capacity;
+	pool->output = output;
+	pool->done = done;
+	pool->slots = calloc( capacity, sizeof( struct MiniRV32IMAPoolSlot ) );
+	pool->sleepers = calloc( capacity, sizeof( struct MiniRV32IMAPoolSlot * ) );
+	pool->queues = calloc( threads, sizeof( struct MiniRV32IMAPoolQueue ) );
+	pthread_mutex_init( &pool->lock, 0 );
+	pthread_cond_init( &pool->wakeup, 0 );
+	for( i = 0; pool->queues && i < threads; i++ )
+	{
+		pool->queues[i].pool = pool;
+		pthread_mutex_init( &pool->queues[i].lock, 0 );
+		if( !( pool->queues[i].slots = calloc( capacity, sizeof( struct MiniRV32IMAPoolSlot * ) ) ) ) break;
+	}
+	if( !pool->slots || !pool->sleepers || !pool->queues || i < threads )
+	{
+		MiniRV32IMAPoolDestroy( pool );
+		return 0;
+	}
+	return pool;
+}
+
+MINIRV32_DECORATE void MiniRV32IMAPoolDestroy( struct MiniRV32IMAPool * pool )
+{
+	int i;
+	if( !pool ) return;
+	for( i = 0; pool->queues && i < pool->threads; i++ )
+	{
+		pthread_mutex_destroy( &pool->queues[i].lock );
+		free( pool->queues[i].slots );
+	}
+	pthread_mutex_destroy( &pool->lock );
+	pthread_cond_destroy( &pool->wakeup );
+	free( pool->queues );
+	free( pool->sleepers );
+	free( pool->slots );
+	free( pool );
+}
+
+// Returns how many are queued now.
+static uint32_t MiniRV32IMAPoolPush( struct MiniRV32IMAPoolQueue * q, struct MiniRV32IMAPoolSlot * slot )
+{
+	pthread_mutex_lock( &q->lock );
+	q->slots[( q->head + q->count ) % q->pool->capacity] = slot;
+	uint32_t count = ++q->count;
+	pthread_mutex_unlock( &q->lock );
+	return count;
+}
+
+// Takes the VM that's waited longest, or 0.
+static struct MiniRV32IMAPoolSlot * MiniRV32IMAPoolPop( struct MiniRV32IMAPoolQueue * q )
+{
+	struct MiniRV32IMAPoolSlot * slot = 0;
+	pthread_mutex_lock( &q->lock );
+	if( q->count )
+	{
+		slot = q->slots[q->head];
+		q->head = ( q->head + 1 ) % q->pool->capacity;
+		q->count--;
+	}
+	pthread_mutex_unlock( &q->lock );
+	return slot;
+}
+
+// The sleepers heap, under pool->lock.
+static void MiniRV32IMAPoolHeapSet( struct MiniRV32IMAPool * pool, int i, struct MiniRV32IMAPoolSlot * slot )
+{
+	pool->sleepers[i] = slot;
+	slot->parked = i;
+}
+
+static void MiniRV32IMAPoolHeapFix( struct MiniRV32IMAPool * pool, int i )
+{
+	struct MiniRV32IMAPoolSlot * slot = pool->sleepers[i];
+	while( i > 0 && pool->sleepers[( i - 1 ) / 2]->wake > slot->wake )
+	{
+		MiniRV32IMAPoolHeapSet( pool, i, pool->sleepers[( i - 1 ) / 2] );
+		i = ( i - 1 ) / 2;
+	}
+	for( ;; )
+	{
+		int child = i * 2 + 1;
+		if( child >= pool->sleeping ) break;
+		if( child + 1 < pool->sleeping && pool->sleepers[child + 1]->wake < pool->sleepers[child]->wake ) child++;
+		if( pool->sleepers[child]->wake >= slot->wake ) break;
+		MiniRV32IMAPoolHeapSet( pool, i, pool->sleepers[child] );
+		i = child;
+	}
+	MiniRV32IMAPoolHeapSet( pool, i, slot );
+}
+
+static void MiniRV32IMAPoolUnpark( struct MiniRV32IMAPool * pool, struct MiniRV32IMAPoolSlot * slot )
+{
+	int i = slot->parked;
+	slot->parked = -1;
+	if( i != --pool->sleeping )
+	{
+		pool->sleepers[i] = pool->sleepers[pool->sleeping];
+		MiniRV32IMAPoolHeapFix( pool, i );
+	}
+}
+
+// Returns 0 if it has input waiting, so shouldn't sleep after all.
+static int MiniRV32IMAPoolPark( struct MiniRV32IMAPool * pool, struct MiniRV32IMAPoolSlot * slot, uint64_t wake )
+{
+	int parked = 0;
+	pthread_mutex_lock( &pool->lock );
+	if( !slot->input_len )
+	{
+		slot->wake = wake;
+		pool->sleepers[pool->sleeping] = slot;
+		MiniRV32IMAPoolHeapFix( pool, pool->sleeping++ );
+		parked = 1;
+	}
+	pthread_mutex_unlock( &pool->lock );
+	return parked;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAPoolAdd( struct MiniRV32IMAPool * pool, struct MiniRV32IMAVM * vm, uint64_t budget, void * user )
+{
+	if( pool->count == pool->capacity ) return -1;
+	int id = pool->count++;
+	struct MiniRV32IMAPoolSlot * slot = &pool->slots[id];
+	slot->vm = vm;
+	slot->user = user;
+	slot->budget = budget;
+	slot->parked = -1;
+	pool->live++;
+	MiniRV32IMAPoolPush( &pool->queues[id % pool->threads], slot );
+	return id;
+}
+
+MINIRV32_DECORATE uint32_t MiniRV32IMAPoolInput( struct MiniRV32IMAPool * pool, int id, const uint8_t * buf, uint32_t len )
+{
+	struct MiniRV32IMAPoolSlot * slot = &pool->slots[id];
+	pthread_mutex_lock( &pool->lock );
+	if( len > MINIRV32_VM_INPUT_SIZE - slot->input_len ) len = MINIRV32_VM_INPUT_SIZE - slot->input_len;
+	memcpy( slot->input + slot->input_len, buf, len );
+	slot->input_len += len;
+	if( len && slot->parked >= 0 )
+	{
+		MiniRV32IMAPoolUnpark( pool, slot );
+		MiniRV32IMAPoolPush( &pool->queues[id % pool->threads], slot );
+		pthread_cond_signal( &pool->wakeup );
+	}
+	pthread_mutex_unlock( &pool->lock );
+	return len;
+}
+
+// Gives a VM its turn, returns why it stopped.
+static int MiniRV32IMAPoolTurn( struct MiniRV32IMAPool * pool, struct MiniRV32IMAPoolSlot * slot )
+{
+	struct MiniRV32IMAVM * vm = slot->vm;
+	uint8_t buf[MINIRV32_VM_OUTPUT_SIZE];
+	uint32_t len;
+	uint64_t ran = 0;
+	int why = MINIRV32_VM_OK;
+
+	pthread_mutex_lock( &pool->lock );
+	len = MiniRV32IMAVMWriteInput( vm, slot->input, slot->input_len );
+	memmove( slot->input, slot->input + len, slot->input_len - len );
+	slot->input_len -= len;
+	pthread_mutex_unlock( &pool->lock );
+
+	while( ran < MINIRV32_POOL_QUANTUM && slot->budget )
+	{
+		// Bill what actually ran, slices can end early.  With lock_time, a WFI
+		// skips straight to the timer, which counts too.
+		uint64_t cycle = ((uint64_t)vm->core->cycleh << 32) | vm->core->cyclel;
+		why = MiniRV32IMAVMRun( vm, ( slot->budget < MINIRV32_VM_MAX_SLICE ) ? slot->budget : MINIRV32_VM_MAX_SLICE, MiniRV32IMAPoolTime() );
+		uint64_t done = ( ((uint64_t)vm->core->cycleh << 32) | vm->core->cyclel ) - cycle;
+		ran += done;
+		slot->budget -= ( done < slot->budget ) ? done : slot->budget;
+		if( ( len = MiniRV32IMAVMReadOutput( vm, buf, sizeof( buf ) ) ) && pool->output )
+			pool->output( slot->user, buf, len );
+		if( why == MINIRV32_VM_UNKNOWN ) why = MINIRV32_VM_OK; // Ignored, like mini-rv32ima.c does.
+		if( why != MINIRV32_VM_OK ) break;
+	}
+	return why;
+}
+
+static void * MiniRV32IMAPoolWorker( void * arg )
+{
+	struct MiniRV32IMAPoolQueue * own = arg;
+	struct MiniRV32IMAPool * pool = own->pool;
+	int me = own - pool->queues;
+	uint64_t instructions = 0;
+	int i;
+
+	for( ;; )
+	{
+		if( __atomic_load_n( &pool->stop, __ATOMIC_ACQUIRE ) )
+			break;
+
+		struct MiniRV32IMAPoolSlot * slot = MiniRV32IMAPoolPop( own );
+		for( i = 1; !slot && i < pool->threads; i++ )
+			slot = MiniRV32IMAPoolPop( &pool->queues[( me + i ) % pool->threads] );
+
+		if( !slot )
+		{
+			// Nothing to run or steal, see if any parked VMs are due.
+			pthread_mutex_lock( &pool->lock );
+			uint64_t now = MiniRV32IMAPoolTime();
+			int woke = 0;
+			while( pool->sleeping && pool->sleepers[0]->wake <= now )
+			{
+				struct MiniRV32IMAPoolSlot * due = pool->sleepers[0];
+				MiniRV32IMAPoolUnpark( pool, due );
+				MiniRV32IMAPoolPush( own, due );
+				woke++;
+			}
+			if( !pool->live )
+			{
+				pthread_mutex_unlock( &pool->lock );
+				break;
+			}
+			if( !woke )
+			{
+				// Anyone queueing more work than they can run signals us, but
+				// they queue it before taking the lock, so don't wait too long regardless.
+				uint64_t until = now + MINIRV32_POOL_MAX_WAIT;
+				if( pool->sleeping && pool->sleepers[0]->wake < until ) until = pool->sleepers[0]->wake;
+				struct timespec ts = { until / 1000000, ( until % 1000000 ) * 1000 };
+				pool->idle++;
+				pthread_cond_timedwait( &pool->wakeup, &pool->lock, &ts );
+				pool->idle--;
+			}
+			else if( woke > 1 && pool->idle )
+				pthread_cond_broadcast( &pool->wakeup );
+			pthread_mutex_unlock( &pool->lock );
+			continue;
+		}
+
+		struct MiniRV32IMAState * core = slot->vm->core;
+		uint64_t cycle = ((uint64_t)core->cycleh << 32) | core->cyclel;
+		int why = MiniRV32IMAPoolTurn( pool, slot );
+		instructions += ( ((uint64_t)core->cycleh << 32) | core->cyclel ) - cycle;
+
+		if( why == MINIRV32_VM_WFI )
+		{
+			uint64_t idle = MiniRV32IMAVMIdleMicroseconds( slot->vm );
+			if( idle && MiniRV32IMAPoolPark( pool, slot, MiniRV32IMAPoolTime() + idle ) )
+				continue;
+			why = MINIRV32_VM_OK;
+		}
+		if( why == MINIRV32_VM_OK && slot->budget )
+		{
+			// More than we can run at once, let an idle worker take some.
+			if( MiniRV32IMAPoolPush( own, slot ) > 1 )
+			{
+				pthread_mutex_lock( &pool->lock );
+				if( pool->idle ) pthread_cond_signal( &pool->wakeup );
+				pthread_mutex_unlock( &pool->lock );
+			}
+			continue;
+		}
+
+		if( pool->done )
+			pool->done( slot->user, slot->vm, why );
+		pthread_mutex_lock( &pool->lock );
+		if( !--pool->live )
+			pthread_cond_broadcast( &pool->wakeup );
+		pthread_mutex_unlock( &pool->lock );
+	}
+
+	pthread_mutex_lock( &pool->lock );
+	pool->instructions += instructions;
+	pthread_mutex_unlock( &pool->lock );
+	return 0;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAPoolRun( struct MiniRV32IMAPool * pool )
+{
+	int i, started;
+	for( started = 0; started < pool->threads; started++ )
+		if( pthread_create( &pool->queues[started].thread, 0, MiniRV32IMAPoolWorker, &pool->queues[started] ) )
+			break;
+	if( started < pool->threads )
+	{
+		// The ones that did start can't finish without the others' VMs, so
+		// take them all back and stop.  Whatever they're running when they
+		// notice is left as it is.
+		pthread_mutex_lock( &pool->lock );
+		for( i = 0; i < pool->count; i++ )
+			if( pool->slots[i].parked >= 0 ) MiniRV32IMAPoolUnpark( pool, &pool->slots[i] );
+		__atomic_store_n( &pool->stop, 1, __ATOMIC_RELEASE );
+		pthread_cond_broadcast( &pool->wakeup );
+		pthread_mutex_unlock( &pool->lock );
+	}
+	for( i = 0; i < started; i++ )
+		pthread_join( pool->queues[i].thread, 0 );
+	return started < pool->threads;
+}
+
+#endif
+
+#endif
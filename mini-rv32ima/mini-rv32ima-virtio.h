@@ -0,0 +1,434 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// virtio-mmio devices for mini-rv32ima-vm.h.  Just the modern (version 2)
+// transport with split virtqueues, no indirect descriptors or event index.
+// Requests are handled as soon as the guest writes QueueNotify, reading and
+// writing the buffers right where they are in guest RAM.
+//
+// The block device works straight on the memory the host gives it, usually an
+// mmap'd disk image, so nothing is read in up front and the guest's writes
+// land in the host's page cache.
+//
+// The console is the same UART buffers as the 8250 at 0x10000000, but the
+// guest hands over whole buffers of output rather than trapping on every byte,
+// and gets input a buffer at a time too.
+
+#ifndef _MINI_RV32IMA_VIRTIO_H
+#define _MINI_RV32IMA_VIRTIO_H
+
+#include <stddef.h>
+
+#define MINIRV32_VIRTIO_BLK_BASE   0x10001000
+#define MINIRV32_VIRTIO_CONSOLE_BASE 0x10002000
+#define MINIRV32_VIRTIO_MMIO_SIZE  0x1000
+#define MINIRV32_VIRTIO_QUEUE_SIZE 128 // QueueNumMax.
+#define MINIRV32_VIRTIO_MAX_QUEUES 2
+
+#define MINIRV32_VIRTIO_ID_BLOCK 2
+#define MINIRV32_VIRTIO_ID_CONSOLE 3
+
+struct MiniRV32IMAVirtqueue
+{
+	uint32_t num, ready;
+	uint32_t desc, avail, used; // Guest physical, the high halves are ignored.
+	uint16_t last_avail, used_idx;
+};
+
+struct MiniRV32IMAVirtio
+{
+	uint32_t device_id, queue_count;
+	uint64_t device_features;
+
+	// From here to queues is what the guest's driver sets up, see MiniRV32IMAVirtioSaveState().
+	uint64_t driver_features;
+	uint32_t device_features_sel, driver_features_sel, queue_sel;
+	uint32_t status, interrupt_status;
+	struct MiniRV32IMAVirtqueue queues[MINIRV32_VIRTIO_MAX_QUEUES];
+
+	// Block device.
+	uint8_t * disk;
+	uint64_t disk_size; // Bytes, whole 512 byte sectors.
+	int (*flush)( struct MiniRV32IMAVirtio * dev ); // Nonzero on failure.
+};
+
+// Makes dev a block device on size bytes at disk.  flush, if not 0, is called
+// when the guest asks for what it's written to be made durable.
+MINIRV32_DECORATE void MiniRV32IMAVirtioBlockInit( struct MiniRV32IMAVirtio * dev, uint8_t * disk, uint64_t size, int read_only, int (*flush)( struct MiniRV32IMAVirtio * dev ) );
+
+// Makes dev a console with just the one port, on the VM's UART buffers.
+MINIRV32_DECORATE void MiniRV32IMAVirtioConsoleInit( struct MiniRV32IMAVirtio * dev );
+
+// Back to how it was before the guest's driver touched it, i.e. on reboot.
+MINIRV32_DECORATE void MiniRV32IMAVirtioReset( struct MiniRV32IMAVirtio * dev );
+
+// What the guest's driver set up on dev, MINIRV32_VIRTIO_STATE_SIZE bytes,
+// for saving with the rest of the VM.  The host's side, i.e. the disk, isn't
+// part of it.
+#define MINIRV32_VIRTIO_STATE_SIZE ( offsetof( struct MiniRV32IMAVirtio, disk ) - offsetof( struct MiniRV32IMAVirtio, driver_features ) )
+MINIRV32_DECORATE void MiniRV32IMAVirtioSaveState( const struct MiniRV32IMAVirtio * dev, uint8_t * buf );
+MINIRV32_DECORATE void MiniRV32IMAVirtioLoadState( struct MiniRV32IMAVirtio * dev, const uint8_t * buf );
+
+#ifdef MINIRV32_VM_IMPLEMENTATION
+
+#include <string.h>
+
+#define MINIRV32_VIRTIO_F_VERSION_1  ( 1ULL << 32 )
+#define MINIRV32_VIRTIO_BLK_F_RO     ( 1ULL << 5 )
+#define MINIRV32_VIRTIO_BLK_F_FLUSH  ( 1ULL << 9 )
+#define MINIRV32_VIRTQ_DESC_F_NEXT   1
+#define MINIRV32_VIRTQ_DESC_F_WRITE  2
+#define MINIRV32_VIRTIO_STATUS_NEEDS_RESET 0x40
+
+struct MiniRV32IMAVirtqDesc
+{
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags, next;
+};
+
+MINIRV32_DECORATE void MiniRV32IMAVirtioReset( struct MiniRV32IMAVirtio * dev )
+{
+	dev->driver_features = 0;
+	dev->device_features_sel = dev->driver_features_sel = dev->queue_sel = 0;
+	dev->status = dev->interrupt_status = 0;
+	memset( dev->queues, 0, sizeof( dev->queues ) );
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVirtioSaveState( const struct MiniRV32IMAVirtio * dev, uint8_t * buf )
+{
+	memcpy( buf, &dev->driver_features, MINIRV32_VIRTIO_STATE_SIZE );
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVirtioLoadState( struct MiniRV32IMAVirtio * dev, const uint8_t * buf )
+{
+	memcpy( &dev->driver_features, buf, MINIRV32_VIRTIO_STATE_SIZE );
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVirtioBlockInit( struct MiniRV32IMAVirtio * dev, uint8_t * disk, uint64_t size, int read_only, int (*flush)( struct MiniRV32IMAVirtio * dev ) )
+{
+	memset( dev, 0, sizeof( *dev ) );
+	dev->device_id = MINIRV32_VIRTIO_ID_BLOCK;
+	dev->queue_count = 1;
+	dev->device_features = MINIRV32_VIRTIO_F_VERSION_1 | ( read_only ? MINIRV32_VIRTIO_BLK_F_RO : 0 ) | ( flush ? MINIRV32_VIRTIO_BLK_F_FLUSH : 0 );
+	dev->disk = disk;
+	dev->disk_size = size & ~511ULL;
+	dev->flush = flush;
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVirtioConsoleInit( struct MiniRV32IMAVirtio * dev )
+{
+	memset( dev, 0, sizeof( *dev ) );
+	dev->device_id = MINIRV32_VIRTIO_ID_CONSOLE;
+	dev->queue_count = 2; // receiveq0, transmitq0
+	dev->device_features = MINIRV32_VIRTIO_F_VERSION_1;
+}
+
+// Where len bytes at guest physical addr are in image, or 0 if they aren't all RAM.
+static uint8_t * MiniRV32IMAVirtioGuest( struct MiniRV32IMAVM * vm, uint64_t addr, uint32_t len )
+{
+	uint64_t ofs = addr - MINIRV32_RAM_IMAGE_OFFSET;
+	if( addr < MINIRV32_RAM_IMAGE_OFFSET || ofs > vm->ram_size || len > vm->ram_size - ofs ) return 0;
+	return vm->image + ofs;
+}
+
+// The device wrote to guest RAM behind the core's back.  Returns nonzero if
+// it was over decoded code, which the core has to stop running.
+static int MiniRV32IMAVirtioWroteRAM( struct MiniRV32IMAVM * vm, uint64_t addr, uint32_t len )
+{
+	int code = 0;
+	if( !len ) return 0;
+#if defined( MINIRV32_DIRTY_PAGES ) || defined( MINIRV32_PREDECODE )
+	uint32_t ofs = addr - MINIRV32_RAM_IMAGE_OFFSET;
+	uint32_t end = ofs + len - 1;
+#endif
+#ifdef MINIRV32_DIRTY_PAGES
+	uint32_t page;
+	for( page = ofs >> MINIRV32_DIRTY_PAGE_SHIFT; page <= end >> MINIRV32_DIRTY_PAGE_SHIFT; page++ )
+		vm->dirty[page>>5] |= 1u<<(page&31);
+#endif
+#ifdef MINIRV32_PREDECODE
+	// Only pages with code on them need going over a word at a time.
+	uint32_t o = ofs & ~3;
+	while( o <= end )
+	{
+		uint32_t cp = MINIRV32_CODEPAGE( o );
+		uint32_t page_end = o | ( ( 1 << MINIRV32_PREDECODE_PAGE_SHIFT ) - 1 );
+		if( vm->dcache->codepages[cp>>3] & (1<<(cp&7)) )
+			for( ; o <= page_end && o <= end; o += 4 )
+				code |= MiniRV32IMAInvalidateCode( vm->dcache, o, 4 );
+		o = page_end + 1;
+	}
+#endif
+	return code;
+}
+
+// The next chain of descriptors the driver has made available, into chain.
+// Returns how many there are, 0 if none or it's broken.  It stays available
+// until MiniRV32IMAVirtqDone().
+static uint32_t MiniRV32IMAVirtqNext( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev, struct MiniRV32IMAVirtqueue * q,
+	struct MiniRV32IMAVirtqDesc ** chain, uint16_t * head )
+{
+	if( !q->ready || !q->num || !( dev->status & 4 /* DRIVER_OK */ ) ) return 0;
+	struct MiniRV32IMAVirtqDesc * descs = (struct MiniRV32IMAVirtqDesc *)MiniRV32IMAVirtioGuest( vm, q->desc, 16 * q->num );
+	uint8_t * avail = MiniRV32IMAVirtioGuest( vm, q->avail, 4 + 2 * q->num );
+	if( !descs || !avail || !MiniRV32IMAVirtioGuest( vm, q->used, 4 + 8 * q->num ) )
+	{
+		dev->status |= MINIRV32_VIRTIO_STATUS_NEEDS_RESET;
+		return 0;
+	}
+	if( q->last_avail == *(uint16_t*)( avail + 2 ) ) return 0;
+
+	uint32_t n = 0;
+	uint16_t next = *head = ((uint16_t*)( avail + 4 ))[q->last_avail % q->num];
+	for( ;; )
+	{
+		if( next >= q->num || n == q->num ) // Out of the table, or a loop.
+		{
+			dev->status |= MINIRV32_VIRTIO_STATUS_NEEDS_RESET;
+			return 0;
+		}
+		chain[n++] = &descs[next];
+		if( !( descs[next].flags & MINIRV32_VIRTQ_DESC_F_NEXT ) ) return n;
+		next = descs[next].next;
+	}
+}
+
+// Gives the chain at head back to the driver, with len bytes written into it.
+// Returns nonzero if that landed on code.
+static int MiniRV32IMAVirtqDone( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev, struct MiniRV32IMAVirtqueue * q, uint16_t head, uint32_t len )
+{
+	uint8_t * used = MiniRV32IMAVirtioGuest( vm, q->used, 4 + 8 * q->num );
+	uint32_t * elem = (uint32_t*)( used + 4 + 8 * ( q->used_idx++ % q->num ) );
+	q->last_avail++;
+	elem[0] = head;
+	elem[1] = len;
+	*(uint16_t*)( used + 2 ) = q->used_idx;
+	dev->interrupt_status |= 1; // Used buffer notification.
+	return MiniRV32IMAVirtioWroteRAM( vm, q->used, 4 + 8 * q->num );
+}
+
+// A block request, returns how many bytes it wrote into the guest's buffers.
+static uint32_t MiniRV32IMAVirtioBlockRequest( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev, struct MiniRV32IMAVirtqDesc ** chain, uint32_t n, int * code )
+{
+	uint32_t i, written = 0;
+
+	// Header, then the data, then the status byte on the end of the last buffer.
+	struct MiniRV32IMAVirtqDesc * last = chain[n-1];
+	uint8_t * hdr = MiniRV32IMAVirtioGuest( vm, chain[0]->addr, 16 );
+	uint8_t * status = last->len ? MiniRV32IMAVirtioGuest( vm, last->addr + last->len - 1, 1 ) : 0;
+	if( n < 2 || chain[0]->len < 16 || !hdr || !status || !( last->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) ) return 0;
+	uint32_t type = *(uint32_t*)hdr;
+	uint64_t pos = *(uint64_t*)( hdr + 8 ) * 512;
+	uint8_t st = 0; // VIRTIO_BLK_S_OK
+
+	switch( type )
+	{
+		case 0: // VIRTIO_BLK_T_IN
+		case 1: // VIRTIO_BLK_T_OUT
+			for( i = 1; i < n - 1; i++ )
+			{
+				struct MiniRV32IMAVirtqDesc * d = chain[i];
+				uint8_t * buf = MiniRV32IMAVirtioGuest( vm, d->addr, d->len );
+				if( !buf || ( type == 0 ) != !!( d->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) || pos > dev->disk_size || d->len > dev->disk_size - pos ||
+					( type == 1 && ( dev->device_features & MINIRV32_VIRTIO_BLK_F_RO ) ) )
+				{
+					st = 1; // VIRTIO_BLK_S_IOERR
+					break;
+				}
+				if( type == 0 )
+				{
+					memcpy( buf, dev->disk + pos, d->len );
+					*code |= MiniRV32IMAVirtioWroteRAM( vm, d->addr, d->len );
+					written += d->len;
+				}
+				else
+					memcpy( dev->disk + pos, buf, d->len );
+				pos += d->len;
+			}
+			break;
+		case 4: // VIRTIO_BLK_T_FLUSH
+			if( dev->flush && dev->flush( dev ) ) st = 1;
+			break;
+		case 8: // VIRTIO_BLK_T_GET_ID, up to 20 bytes, no terminator needed.
+		{
+			static const char id[20] = "mini-rv32ima";
+			struct MiniRV32IMAVirtqDesc * d = chain[1];
+			uint32_t len = ( d->len < sizeof( id ) ) ? d->len : sizeof( id );
+			uint8_t * buf = MiniRV32IMAVirtioGuest( vm, d->addr, len );
+			if( n < 3 || !buf || !( d->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) ) { st = 1; break; }
+			memcpy( buf, id, len );
+			*code |= MiniRV32IMAVirtioWroteRAM( vm, d->addr, len );
+			written += len;
+			break;
+		}
+		default:
+			st = 2; // VIRTIO_BLK_S_UNSUPP
+			break;
+	}
+	*status = st;
+	*code |= MiniRV32IMAVirtioWroteRAM( vm, last->addr + last->len - 1, 1 );
+	return written + 1;
+}
+
+static int MiniRV32IMAVirtioBlockNotify( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev )
+{
+	struct MiniRV32IMAVirtqDesc * chain[MINIRV32_VIRTIO_QUEUE_SIZE];
+	struct MiniRV32IMAVirtqueue * q = &dev->queues[0];
+	uint32_t n;
+	uint16_t head;
+	int code = 0;
+	while( ( n = MiniRV32IMAVirtqNext( vm, dev, q, chain, &head ) ) )
+	{
+		uint32_t len = MiniRV32IMAVirtioBlockRequest( vm, dev, chain, n, &code );
+		code |= MiniRV32IMAVirtqDone( vm, dev, q, head, len );
+	}
+	return code;
+}
+
+// Moves whole buffers of output into the VM's UART buffer.  Returns nonzero
+// if the host needs to empty it before there's room for more, or if it landed
+// on code.  What's left is picked up by MiniRV32IMAVirtioConsolePoll().
+static int MiniRV32IMAVirtioConsoleTransmit( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev )
+{
+	struct MiniRV32IMAVirtqDesc * chain[MINIRV32_VIRTIO_QUEUE_SIZE];
+	struct MiniRV32IMAVirtqueue * q = &dev->queues[1];
+	uint32_t n, i;
+	uint16_t head;
+	int code = 0;
+	while( ( n = MiniRV32IMAVirtqNext( vm, dev, q, chain, &head ) ) )
+	{
+		uint32_t len = 0;
+		for( i = 0; i < n; i++ )
+			if( !( chain[i]->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) ) len += chain[i]->len;
+		// Anything too big even for an empty buffer just gets cut short.
+		if( vm->output_len && len > MINIRV32_VM_OUTPUT_SIZE - vm->output_len )
+			return 1;
+		for( i = 0; i < n; i++ )
+		{
+			uint8_t * buf = MiniRV32IMAVirtioGuest( vm, chain[i]->addr, chain[i]->len );
+			if( buf && !( chain[i]->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) )
+				MiniRV32IMAVMPutOutput( vm, (const char *)buf, chain[i]->len );
+		}
+		code |= MiniRV32IMAVirtqDone( vm, dev, q, head, 0 );
+	}
+	return code;
+}
+
+// Fills the guest's receive buffers from the VM's UART input.  Returns nonzero
+// if that landed on code.
+static int MiniRV32IMAVirtioConsoleReceive( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev )
+{
+	struct MiniRV32IMAVirtqDesc * chain[MINIRV32_VIRTIO_QUEUE_SIZE];
+	struct MiniRV32IMAVirtqueue * q = &dev->queues[0];
+	uint32_t n, i;
+	uint16_t head;
+	int code = 0;
+	while( ( n = MiniRV32IMAVirtqNext( vm, dev, q, chain, &head ) ) )
+	{
+		uint32_t len = 0;
+		if( vm->input_head == vm->input_tail )
+		{
+			// The guest is waiting for input, have the host look for some.
+			vm->input_polled = 1;
+			break;
+		}
+		for( i = 0; i < n; i++ )
+		{
+			uint8_t * buf = MiniRV32IMAVirtioGuest( vm, chain[i]->addr, chain[i]->len );
+			uint32_t got = 0;
+			if( !buf || !( chain[i]->flags & MINIRV32_VIRTQ_DESC_F_WRITE ) ) continue;
+			while( got < chain[i]->len && vm->input_head != vm->input_tail )
+				buf[got++] = MiniRV32IMAVMGetInput( vm );
+			code |= MiniRV32IMAVirtioWroteRAM( vm, chain[i]->addr, got );
+			len += got;
+		}
+		code |= MiniRV32IMAVirtqDone( vm, dev, q, head, len );
+	}
+	return code;
+}
+
+// Between slices, carries on with output that didn't fit last time and takes
+// any new input.
+static void MiniRV32IMAVirtioConsolePoll( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev )
+{
+	if( !( dev->status & 4 /* DRIVER_OK */ ) ) return;
+	MiniRV32IMAVirtioConsoleTransmit( vm, dev );
+	MiniRV32IMAVirtioConsoleReceive( vm, dev );
+}
+
+// Does everything the guest has queued on a queue.  Returns nonzero if the
+// core needs to stop, because that changed code or the output is full.
+static int MiniRV32IMAVirtioNotify( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev, uint32_t queue )
+{
+	if( queue >= dev->queue_count ) return 0;
+	if( dev->device_id == MINIRV32_VIRTIO_ID_BLOCK )
+		return MiniRV32IMAVirtioBlockNotify( vm, dev );
+	if( queue == 0 )
+		return MiniRV32IMAVirtioConsoleReceive( vm, dev );
+	return MiniRV32IMAVirtioConsoleTransmit( vm, dev ) || vm->output_len > MINIRV32_VM_OUTPUT_SIZE - 1024;
+}
+
+static uint32_t MiniRV32IMAVirtioLoad( struct MiniRV32IMAVirtio * dev, uint32_t ofs )
+{
+	struct MiniRV32IMAVirtqueue * q = ( dev->queue_sel < dev->queue_count ) ? &dev->queues[dev->queue_sel] : 0;
+	if( ofs >= 0x100 )
+	{
+		// Config space, for a block device just the capacity in sectors.  The
+		// console doesn't offer anything that needs it.
+		uint8_t config[8];
+		uint64_t capacity = dev->disk_size / 512;
+		uint32_t val = 0;
+		if( dev->device_id != MINIRV32_VIRTIO_ID_BLOCK ) return 0;
+		memcpy( config, &capacity, sizeof( config ) );
+		ofs -= 0x100;
+		if( ofs < sizeof( config ) )
+			memcpy( &val, config + ofs, ( sizeof( config ) - ofs < 4 ) ? sizeof( config ) - ofs : 4 );
+		return val;
+	}
+	switch( ofs )
+	{
+		case 0x000: return 0x74726976; // MagicValue, "virt"
+		case 0x004: return 2; // Version
+		case 0x008: return dev->device_id;
+		case 0x00c: return 0x32335652; // VendorID, "RV32"
+		case 0x010: return ( dev->device_features_sel < 2 ) ? (uint32_t)( dev->device_features >> ( 32 * dev->device_features_sel ) ) : 0;
+		case 0x034: return q ? MINIRV32_VIRTIO_QUEUE_SIZE : 0; // QueueNumMax
+		case 0x044: return q ? q->ready : 0;
+		case 0x060: return dev->interrupt_status;
+		case 0x070: return dev->status;
+		case 0x0fc: return 0; // ConfigGeneration, it never changes.
+		default: return 0;
+	}
+}
+
+// Returns nonzero if the core needs to stop, see MiniRV32IMAVirtioNotify().
+static int MiniRV32IMAVirtioStore( struct MiniRV32IMAVM * vm, struct MiniRV32IMAVirtio * dev, uint32_t ofs, uint32_t val )
+{
+	struct MiniRV32IMAVirtqueue * q = ( dev->queue_sel < dev->queue_count ) ? &dev->queues[dev->queue_sel] : 0;
+	switch( ofs )
+	{
+		case 0x014: dev->device_features_sel = val; break;
+		case 0x020:
+			if( dev->driver_features_sel < 2 )
+			{
+				uint64_t mask = 0xffffffffULL << ( 32 * dev->driver_features_sel );
+				dev->driver_features = ( dev->driver_features & ~mask ) | ( ( (uint64_t)val << ( 32 * dev->driver_features_sel ) ) & mask & dev->device_features );
+			}
+			break;
+		case 0x024: dev->driver_features_sel = val; break;
+		case 0x030: dev->queue_sel = val; break;
+		case 0x038: if( q && val <= MINIRV32_VIRTIO_QUEUE_SIZE ) q->num = val; break;
+		case 0x044: if( q ) q->ready = val & 1; break;
+		case 0x050: return MiniRV32IMAVirtioNotify( vm, dev, val );
+		case 0x064: dev->interrupt_status &= ~val; break;
+		case 0x070: if( val ) dev->status = val; else MiniRV32IMAVirtioReset( dev ); break;
+		case 0x080: if( q ) q->desc = val; break;
+		case 0x090: if( q ) q->avail = val; break;
+		case 0x0a0: if( q ) q->used = val; break;
+	}
+	return 0;
+}
+
+#endif
+
+#endif
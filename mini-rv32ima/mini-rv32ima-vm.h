@@ -0,0 +1,839 @@
+// Copyright 2022 Charles Lohr, you may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+// A whole machine around mini-rv32ima.h, for hosts that want to run one or
+// many without keeping anything in globals.  Each struct MiniRV32IMAVM owns its
+// RAM (or borrows the host's), its core, CLINT, PLIC, syscon, a 16550A UART
+// at 0x10000000 with a virtio console on the same buffers, and with
+// MINIRV32_PREDECODE its own decode cache.  The host can plug in a virtio
+// block device, see mini-rv32ima-virtio.h.  Like in
+// mini-rv32ima.c, the core lives at the end of RAM.  The devices don't, so a
+// copy of the whole machine is a copy of RAM and MiniRV32IMAVMSaveDevices().
+//
+//	#define MINIRV32_VM_IMPLEMENTATION
+//	#include "mini-rv32ima-vm.h"
+//
+//	struct MiniRV32IMAVM * vm = MiniRV32IMAVMCreate( 64*1024*1024, 0 );
+//	memcpy( vm->image, kernel, kernel_len ); // And a DTB, see mini-rv32ima-fdt.h.
+//	MiniRV32IMAVMBoot( vm, MINIRV32_RAM_IMAGE_OFFSET, dtb_pa );
+//	MiniRV32IMAVMStart( vm, now );
+//	while( ( why = MiniRV32IMAVMRun( vm, budget, now ) ) != MINIRV32_VM_POWEROFF )
+//	{
+//		len = MiniRV32IMAVMReadOutput( vm, buf, sizeof( buf ) );
+//		...
+//	}
+//	MiniRV32IMAVMDestroy( vm );
+//
+// This includes mini-rv32ima.h itself, with its own hooks, so a program using
+// it can't also use mini-rv32ima.h directly.  Any other MINIRV32_* options go
+// before the first include.  A VM can move between threads, but only one may
+// run it at a time.  MINIRV32_PAIR_HISTOGRAM counts are shared by all of them.
+// On a target without thread-local storage, define MINIRV32_VM_THREAD_LOCAL
+// as nothing and run them all from one thread.
+
+#ifndef _MINI_RV32IMA_VM_H
+#define _MINI_RV32IMA_VM_H
+
+#include <stdint.h>
+
+#ifndef MINIRV32_VM_THREAD_LOCAL
+	#if defined( _MSC_VER )
+		#define MINIRV32_VM_THREAD_LOCAL __declspec( thread )
+	#else
+		#define MINIRV32_VM_THREAD_LOCAL __thread
+	#endif
+#endif
+
+#define MINIRV32_VM_MIN_SLICE 1024    // Fewest instructions per slice, so a masked, pending interrupt is noticed soon after it's unmasked.
+#define MINIRV32_VM_MAX_SLICE (1<<20) // Most instructions per slice.
+#define MINIRV32_VM_MAX_IDLE 100000   // Longest a VM in WFI without a timer should sleep, in microseconds.
+#define MINIRV32_VM_OUTPUT_SIZE 4096  // UART output buffered between MiniRV32IMAVMRun() calls.
+#define MINIRV32_VM_INPUT_SIZE 256    // UART input waiting for the guest, must be a power of two.
+#define MINIRV32_VM_UART_FIFO 16      // 16550A receive FIFO, must be a power of two.
+
+// The PLIC, and the sources wired to it.  Source 0 doesn't exist.
+#define MINIRV32_VM_PLIC_BASE 0x10400000
+#define MINIRV32_VM_PLIC_SIZE 0x400000
+#define MINIRV32_VM_PLIC_SOURCES 32
+#define MINIRV32_VM_IRQ_VIRTIO_BLK 1
+#define MINIRV32_VM_IRQ_VIRTIO_CONSOLE 2
+#define MINIRV32_VM_IRQ_UART 10
+
+// What MiniRV32IMAVMRun() stopped for.
+enum MiniRV32IMAVMExit
+{
+	MINIRV32_VM_OK = 0,   // Ran a slice, keep going.
+	MINIRV32_VM_WFI,      // Waiting for an interrupt, nothing to do for MiniRV32IMAVMIdleMicroseconds().
+	MINIRV32_VM_POWEROFF,
+	MINIRV32_VM_REBOOT,   // The host should reload RAM and boot it again.
+	MINIRV32_VM_FAULT,    // Any trap, with fail_on_all_faults.
+	MINIRV32_VM_UNKNOWN,  // Something else written to the syscon.
+};
+
+// A 16550A at 0x10000000.  What the guest transmits goes straight into the
+// output buffer, so the transmitter is always empty.
+struct MiniRV32IMAVMUART
+{
+	uint8_t ier, lcr, mcr, fcr, scr, dll, dlm;
+	uint8_t thri; // Transmitter empty interrupt, until IIR says so or THR is written.
+	uint8_t rx[MINIRV32_VM_UART_FIFO];
+	uint8_t rx_head, rx_count;
+};
+
+// A PLIC with a single context, the hart in M-mode, so it drives MEIP.  All
+// sources are level triggered.
+struct MiniRV32IMAVMPLIC
+{
+	uint8_t priority[MINIRV32_VM_PLIC_SOURCES];
+	uint32_t pending, enable, claimed; // One bit per source.
+	uint32_t threshold;
+};
+
+struct MiniRV32IMAVM
+{
+	uint8_t * image;
+	uint32_t ram_size;
+	struct MiniRV32IMAState * core; // The last bytes of image.
+	int32_t (*step)( struct MiniRV32IMAState *, uint8_t *, uint32_t, uint32_t, int );
+	int owns_image;
+
+	// Set these after MiniRV32IMAVMCreate().
+	int fail_on_all_faults;
+	int time_divisor; // Guest microseconds are this many host ones, or with lock_time, instructions.
+	int lock_time;    // Time moves with instructions run rather than with the host clock.
+
+	uint32_t slice; // Instructions the last MiniRV32IMAVMRun() was allowed.
+	uint64_t last_time;
+	uint64_t timer_deadline_cycle; // With lock_time, the cycle at which the timer interrupt fires.
+	uint64_t slice_instrs, slice_time; // Without, to guess how many instructions a timer tick is.
+	uint64_t slice_cycle; // Cycle count when the last slice started.
+	int slept;            // The last slice ended in WFI, so the time since then was spent asleep.
+	int reschedule;       // A device store ended the slice early, see MiniRV32IMAVMStore().
+
+	uint8_t output[MINIRV32_VM_OUTPUT_SIZE];
+	uint32_t output_len;
+	uint8_t input[MINIRV32_VM_INPUT_SIZE];
+	uint32_t input_head, input_tail;
+	int input_polled; // The guest looked for input and there wasn't any.
+	struct MiniRV32IMAVMUART uart;
+	struct MiniRV32IMAVMPLIC plic;
+
+#ifdef MINIRV32_DIRTY_PAGES
+	uint32_t * dirty; // One bit per 4kB page of RAM.
+#endif
+#ifdef MINIRV32_PAGE_ATTRS
+	uint8_t * pageattrs; // Reset it with MiniRV32IMAResetPageAttrs() after marking pages clean.
+#endif
+	struct MiniRV32IMADecodeCache * dcache; // With MINIRV32_PREDECODE.
+	struct MiniRV32IMAVirtio * blk; // At MINIRV32_VIRTIO_BLK_BASE, or 0.  The host sets it up and owns it.
+	struct MiniRV32IMAVirtio * console; // At MINIRV32_VIRTIO_CONSOLE_BASE.
+};
+
+#ifdef MINIRV32_VM_IMPLEMENTATION
+
+static MINIRV32_VM_THREAD_LOCAL struct MiniRV32IMAVM * MiniRV32IMAVMCurrent; // The one this thread is running.
+static uint32_t MiniRV32IMAVMStore( struct MiniRV32IMAVM * vm, uint32_t addy, uint32_t val );
+static uint32_t MiniRV32IMAVMLoad( struct MiniRV32IMAVM * vm, uint32_t addy );
+static void MiniRV32IMAVMCSRWrite( struct MiniRV32IMAVM * vm, uint16_t csrno, uint32_t value );
+static int32_t MiniRV32IMAVMCSRRead( struct MiniRV32IMAVM * vm, uint16_t csrno );
+static int MiniRV32IMAVMGetInput( struct MiniRV32IMAVM * vm );
+static void MiniRV32IMAVMPutOutput( struct MiniRV32IMAVM * vm, const char * s, uint32_t len );
+static void MiniRV32IMAVMUARTPoll( struct MiniRV32IMAVM * vm );
+static int MiniRV32IMAVMUpdateIRQ( struct MiniRV32IMAVM * vm );
+
+// Everything mini-rv32ima.h would take from globals comes from the VM being run.
+#define MINI_RV32_RAM_SIZE ( MiniRV32IMAVMCurrent->ram_size )
+#define MINIRV32_DECODE_CACHE ( MiniRV32IMAVMCurrent->dcache )
+#define MINIRV32_DIRTY_BITMAP ( MiniRV32IMAVMCurrent->dirty )
+#define MINIRV32_PAGE_ATTR_TABLE ( MiniRV32IMAVMCurrent->pageattrs )
+#define MINIRV32_IMPLEMENTATION
+#define MINIRV32_POSTEXEC( pc, ir, retval ) { if( retval > 0 && MiniRV32IMAVMCurrent->fail_on_all_faults ) return 3; }
+#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) { uint32_t hret = MiniRV32IMAVMStore( MiniRV32IMAVMCurrent, addy, val ); if( hret ) return hret; }
+#define MINIRV32_HANDLE_MEM_LOAD_CONTROL( addy, rval ) rval = MiniRV32IMAVMLoad( MiniRV32IMAVMCurrent, addy );
+#define MINIRV32_OTHERCSR_WRITE( csrno, value ) MiniRV32IMAVMCSRWrite( MiniRV32IMAVMCurrent, csrno, value );
+#define MINIRV32_OTHERCSR_READ( csrno, value ) value = MiniRV32IMAVMCSRRead( MiniRV32IMAVMCurrent, csrno );
+
+#endif
+
+#include "mini-rv32ima.h"
+
+// Returns 0 if out of memory.  With image 0, the VM allocates its own RAM,
+// otherwise it uses ram_size bytes there, which must stay valid until
+// MiniRV32IMAVMDestroy().
+MINIRV32_DECORATE struct MiniRV32IMAVM * MiniRV32IMAVMCreate( uint32_t ram_size, uint8_t * image );
+MINIRV32_DECORATE void MiniRV32IMAVMDestroy( struct MiniRV32IMAVM * vm );
+
+// Sets the core up to start at pc with a fresh image in RAM, and resets the
+// devices.  Drops decoded code.
+MINIRV32_DECORATE void MiniRV32IMAVMBoot( struct MiniRV32IMAVM * vm, uint32_t pc, uint32_t dtb_pa );
+
+// Puts the UART, PLIC and virtio devices back how they were at power on.
+// What's buffered for the host either way is left alone.
+MINIRV32_DECORATE void MiniRV32IMAVMResetDevices( struct MiniRV32IMAVM * vm );
+
+// Device state that isn't in RAM: the UART, PLIC, virtio devices and the
+// buffered input and output.  A host saving RAM, i.e. in a snapshot, has to
+// save this as well.  Returns how many bytes it is, and writes them to buf if
+// they fit in size.
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMSaveDevices( struct MiniRV32IMAVM * vm, uint8_t * buf, uint32_t size );
+
+// Puts back what MiniRV32IMAVMSaveDevices() saved, for a VM with the same
+// devices plugged in.  Returns 0, or -1 if buf isn't that and nothing changed.
+MINIRV32_DECORATE int MiniRV32IMAVMLoadDevices( struct MiniRV32IMAVM * vm, const uint8_t * buf, uint32_t len );
+
+// Drops decoded code, must be called if the host changes RAM behind the guest's back.
+MINIRV32_DECORATE void MiniRV32IMAVMFlush( struct MiniRV32IMAVM * vm );
+
+// Restarts the clock, before running a VM for the first time or after its
+// core was changed by the host, i.e. restored from a snapshot.  now is the
+// host time in microseconds, and isn't used with lock_time.
+MINIRV32_DECORATE void MiniRV32IMAVMStart( struct MiniRV32IMAVM * vm, uint64_t now );
+
+// Runs up to budget instructions, stopping early at the next timer interrupt,
+// so each call is one slice.  Returns a MiniRV32IMAVMExit.
+MINIRV32_DECORATE int MiniRV32IMAVMRun( struct MiniRV32IMAVM * vm, uint32_t budget, uint64_t now );
+
+// After MINIRV32_VM_WFI, how long until there's anything to do, 0 if now.
+MINIRV32_DECORATE uint64_t MiniRV32IMAVMIdleMicroseconds( struct MiniRV32IMAVM * vm );
+
+// Takes up to len bytes the guest wrote to the UART, returns how many.  A
+// slice ends early when the buffer is almost full, so this should be called
+// after every MiniRV32IMAVMRun().
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMReadOutput( struct MiniRV32IMAVM * vm, uint8_t * buf, uint32_t len );
+
+// Queues input for the guest's UART, returns how many of the len bytes fit.
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMWriteInput( struct MiniRV32IMAVM * vm, const uint8_t * buf, uint32_t len );
+
+#include "mini-rv32ima-virtio.h"
+
+#ifdef MINIRV32_VM_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ends a slice early, see MiniRV32IMAVMStore().  The guest can make the step
+// return any value through syscon, so it's vm->reschedule that says this
+// was one of ours.
+#define MINIRV32_VM_STEP_RESCHEDULE( vm ) ( ( vm )->reschedule = 1 )
+
+// Cores with common RAM sizes baked in, MiniRV32IMAStep handles any other.
+MINIRV32_STEP_SPECIALIZE( MiniRV32IMAVMStep16M, 16*1024*1024 )
+MINIRV32_STEP_SPECIALIZE( MiniRV32IMAVMStep32M, 32*1024*1024 )
+MINIRV32_STEP_SPECIALIZE( MiniRV32IMAVMStep64M, 64*1024*1024 )
+MINIRV32_STEP_SPECIALIZE( MiniRV32IMAVMStep128M, 128*1024*1024 )
+
+MINIRV32_DECORATE struct MiniRV32IMAVM * MiniRV32IMAVMCreate( uint32_t ram_size, uint8_t * image )
+{
+	if( ram_size < sizeof( struct MiniRV32IMAState ) + 4 ) return 0;
+	struct MiniRV32IMAVM * vm = calloc( 1, sizeof( struct MiniRV32IMAVM ) );
+	if( !vm ) return 0;
+	vm->owns_image = !image;
+	vm->image = image ? image : calloc( 1, ram_size );
+	vm->ram_size = ram_size;
+#ifdef MINIRV32_DIRTY_PAGES
+	vm->dirty = calloc( ( ( ram_size >> MINIRV32_DIRTY_PAGE_SHIFT ) + 32 ) / 32, sizeof( uint32_t ) );
+	if( !vm->dirty )
+	{
+		MiniRV32IMAVMDestroy( vm );
+		return 0;
+	}
+#endif
+#ifdef MINIRV32_PAGE_ATTRS
+	// Only the entries for RAM get written, the rest stay untouched zero pages.
+	vm->pageattrs = calloc( MINIRV32_PAGE_ATTR_ENTRIES, 1 );
+	if( !vm->pageattrs )
+	{
+		MiniRV32IMAVMDestroy( vm );
+		return 0;
+	}
+	MiniRV32IMAResetPageAttrs( vm->pageattrs, ram_size );
+#endif
+#ifdef MINIRV32_PREDECODE
+	vm->dcache = calloc( 1, sizeof( struct MiniRV32IMADecodeCache ) );
+	if( !vm->dcache )
+	{
+		MiniRV32IMAVMDestroy( vm );
+		return 0;
+	}
+#endif
+	vm->console = calloc( 1, sizeof( struct MiniRV32IMAVirtio ) );
+	if( !vm->image || !vm->console )
+	{
+		MiniRV32IMAVMDestroy( vm );
+		return 0;
+	}
+	MiniRV32IMAVirtioConsoleInit( vm->console );
+	vm->core = (struct MiniRV32IMAState *)( vm->image + ram_size - sizeof( struct MiniRV32IMAState ) );
+	vm->time_divisor = 1;
+	vm->slice = 1;
+	switch( ram_size )
+	{
+		case 16*1024*1024: vm->step = MiniRV32IMAVMStep16M; break;
+		case 32*1024*1024: vm->step = MiniRV32IMAVMStep32M; break;
+		case 64*1024*1024: vm->step = MiniRV32IMAVMStep64M; break;
+		case 128*1024*1024: vm->step = MiniRV32IMAVMStep128M; break;
+		default: vm->step = MiniRV32IMAStep; break;
+	}
+	return vm;
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVMDestroy( struct MiniRV32IMAVM * vm )
+{
+	if( !vm ) return;
+#ifdef MINIRV32_JIT
+	if( vm->dcache && vm->dcache->jitbuf ) munmap( vm->dcache->jitbuf, MINIRV32_JIT_SIZE );
+#endif
+	free( vm->dcache );
+	free( vm->console );
+#ifdef MINIRV32_DIRTY_PAGES
+	free( vm->dirty );
+#endif
+#ifdef MINIRV32_PAGE_ATTRS
+	free( vm->pageattrs );
+#endif
+	if( vm->owns_image ) free( vm->image );
+	free( vm );
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVMFlush( struct MiniRV32IMAVM * vm )
+{
+#ifdef MINIRV32_PREDECODE
+	MiniRV32IMAFlushDecodeCache( vm->dcache );
+#endif
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVMBoot( struct MiniRV32IMAVM * vm, uint32_t pc, uint32_t dtb_pa )
+{
+	memset( vm->core, 0, sizeof( struct MiniRV32IMAState ) );
+	vm->core->pc = pc;
+	vm->core->regs[10] = 0x00; //hart ID
+	vm->core->regs[11] = dtb_pa; //dtb_pa (Must be valid pointer) (Should be pointer to dtb)
+	vm->core->extraflags |= 3; // Machine-mode.
+	MiniRV32IMAVMResetDevices( vm );
+	MiniRV32IMAVMFlush( vm );
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVMResetDevices( struct MiniRV32IMAVM * vm )
+{
+	memset( &vm->uart, 0, sizeof( vm->uart ) );
+	memset( &vm->plic, 0, sizeof( vm->plic ) );
+	if( vm->blk ) MiniRV32IMAVirtioReset( vm->blk );
+	MiniRV32IMAVirtioReset( vm->console );
+}
+
+#define MINIRV32_VM_DEVICES_VERSION 1 // Bump when what MiniRV32IMAVMSaveDevices() writes changes.
+
+// Appends len bytes to the device state, if there's room.
+static void MiniRV32IMAVMPutState( uint8_t * buf, uint32_t size, uint32_t * pos, const void * p, uint32_t len )
+{
+	if( buf && len <= size && *pos <= size - len ) memcpy( buf + *pos, p, len );
+	*pos += len;
+}
+
+// Takes the next len bytes of device state, returns 0 if there aren't that many.
+static int MiniRV32IMAVMGetState( const uint8_t * buf, uint32_t size, uint32_t * pos, void * p, uint32_t len )
+{
+	if( len > size || *pos > size - len ) return 0;
+	memcpy( p, buf + *pos, len );
+	*pos += len;
+	return 1;
+}
+
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMSaveDevices( struct MiniRV32IMAVM * vm, uint8_t * buf, uint32_t size )
+{
+	uint32_t version = MINIRV32_VM_DEVICES_VERSION;
+	uint32_t has_blk = !!vm->blk;
+	uint32_t input_len = vm->input_head - vm->input_tail;
+	uint8_t virtio[MINIRV32_VIRTIO_STATE_SIZE];
+	uint32_t pos = 0, i;
+
+	MiniRV32IMAVMPutState( buf, size, &pos, &version, sizeof( version ) );
+	MiniRV32IMAVMPutState( buf, size, &pos, &vm->uart, sizeof( vm->uart ) );
+	MiniRV32IMAVMPutState( buf, size, &pos, &vm->plic, sizeof( vm->plic ) );
+	MiniRV32IMAVMPutState( buf, size, &pos, &has_blk, sizeof( has_blk ) );
+	if( vm->blk )
+	{
+		MiniRV32IMAVirtioSaveState( vm->blk, virtio );
+		MiniRV32IMAVMPutState( buf, size, &pos, virtio, sizeof( virtio ) );
+	}
+	MiniRV32IMAVirtioSaveState( vm->console, virtio );
+	MiniRV32IMAVMPutState( buf, size, &pos, virtio, sizeof( virtio ) );
+	MiniRV32IMAVMPutState( buf, size, &pos, &vm->output_len, sizeof( vm->output_len ) );
+	MiniRV32IMAVMPutState( buf, size, &pos, vm->output, vm->output_len );
+	MiniRV32IMAVMPutState( buf, size, &pos, &input_len, sizeof( input_len ) );
+	for( i = 0; i < input_len; i++ )
+		MiniRV32IMAVMPutState( buf, size, &pos, &vm->input[( vm->input_tail + i ) & ( MINIRV32_VM_INPUT_SIZE - 1 )], 1 );
+	return pos;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAVMLoadDevices( struct MiniRV32IMAVM * vm, const uint8_t * buf, uint32_t len )
+{
+	// Everything goes somewhere else first, so a bad one changes nothing.
+	uint32_t version = 0, has_blk = 0, output_len = 0, input_len = 0;
+	struct MiniRV32IMAVMUART uart;
+	struct MiniRV32IMAVMPLIC plic;
+	uint8_t blk[MINIRV32_VIRTIO_STATE_SIZE], console[MINIRV32_VIRTIO_STATE_SIZE];
+	uint8_t output[MINIRV32_VM_OUTPUT_SIZE], input[MINIRV32_VM_INPUT_SIZE];
+	uint32_t pos = 0;
+
+	if( !MiniRV32IMAVMGetState( buf, len, &pos, &version, sizeof( version ) ) || version != MINIRV32_VM_DEVICES_VERSION ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, &uart, sizeof( uart ) ) ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, &plic, sizeof( plic ) ) ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, &has_blk, sizeof( has_blk ) ) || has_blk != !!vm->blk ||
+		( has_blk && !MiniRV32IMAVMGetState( buf, len, &pos, blk, sizeof( blk ) ) ) ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, console, sizeof( console ) ) ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, &output_len, sizeof( output_len ) ) || output_len > MINIRV32_VM_OUTPUT_SIZE ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, output, output_len ) ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, &input_len, sizeof( input_len ) ) || input_len > MINIRV32_VM_INPUT_SIZE ||
+		!MiniRV32IMAVMGetState( buf, len, &pos, input, input_len ) ||
+		pos != len )
+		return -1;
+
+	vm->uart = uart;
+	vm->plic = plic;
+	if( has_blk ) MiniRV32IMAVirtioLoadState( vm->blk, blk );
+	MiniRV32IMAVirtioLoadState( vm->console, console );
+	memcpy( vm->output, output, output_len );
+	vm->output_len = output_len;
+	memcpy( vm->input, input, input_len );
+	vm->input_tail = 0;
+	vm->input_head = input_len;
+	vm->input_polled = 0;
+	return 0;
+}
+
+static void MiniRV32IMAVMUpdateTimerDeadline( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAState * core = vm->core;
+	uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+	uint64_t timer = ((uint64_t)core->timerh << 32) | core->timerl;
+	uint64_t cycle = ((uint64_t)core->cycleh << 32) | core->cyclel;
+	// The core fires once the timer is past timermatch.  With lock_time, the
+	// timer goes up by one every time cycle / time_divisor does, counting from
+	// where it is now; a snapshot may have been taken with another -t, or
+	// without -l at all.  0 means never.
+	if( !match || match == ~(uint64_t)0 )
+		vm->timer_deadline_cycle = 0;
+	else if( timer > match )
+		vm->timer_deadline_cycle = cycle ? cycle : 1;
+	else
+	{
+		uint64_t ticks = match + 1 - timer;
+		uint64_t base = cycle / vm->time_divisor;
+		vm->timer_deadline_cycle = ( ticks > ~(uint64_t)0 / vm->time_divisor - base ) ? 0 : ( base + ticks ) * vm->time_divisor;
+	}
+}
+
+MINIRV32_DECORATE void MiniRV32IMAVMStart( struct MiniRV32IMAVM * vm, uint64_t now )
+{
+	uint64_t cycle = ((uint64_t)vm->core->cycleh << 32) | vm->core->cyclel;
+	vm->last_time = ( vm->lock_time ? cycle : now ) / vm->time_divisor;
+	vm->slice = 1;
+	vm->slice_instrs = vm->slice_time = 0;
+	vm->slice_cycle = cycle;
+	vm->slept = 0;
+	MiniRV32IMAVMUpdateTimerDeadline( vm );
+}
+
+// How many instructions to run before the timer interrupt is due.
+static uint32_t MiniRV32IMAVMInstructionsUntilTimer( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAState * core = vm->core;
+	uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+	uint64_t left = MINIRV32_VM_MAX_SLICE;
+
+	if( vm->lock_time && vm->timer_deadline_cycle )
+	{
+		// Exact, so the interrupt lands on the same instruction however big the slices are.
+		uint64_t cycle = ((uint64_t)core->cycleh << 32) | core->cyclel;
+		if( cycle >= vm->timer_deadline_cycle ) return MINIRV32_VM_MIN_SLICE;
+		left = vm->timer_deadline_cycle - cycle;
+	}
+	else if( match && !vm->lock_time )
+	{
+		// Best guess, from how fast we've been running so far.
+		uint64_t timer = ((uint64_t)core->timerh << 32) | core->timerl;
+		if( timer > match || !vm->slice_time ) return MINIRV32_VM_MIN_SLICE;
+		left = ( match + 1 - timer ) * vm->slice_instrs / vm->slice_time;
+		if( left < MINIRV32_VM_MIN_SLICE ) return MINIRV32_VM_MIN_SLICE;
+	}
+
+	// MiniRV32IMAStep only takes interrupts on entry, so while the guest has a
+	// device interrupt masked, look again soon.
+	if( ( core->mip & (1<<11) ) && left > MINIRV32_VM_MIN_SLICE ) return MINIRV32_VM_MIN_SLICE;
+	return ( left > MINIRV32_VM_MAX_SLICE ) ? MINIRV32_VM_MAX_SLICE : (uint32_t)left;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAVMRun( struct MiniRV32IMAVM * vm, uint32_t budget, uint64_t now )
+{
+	struct MiniRV32IMAState * core = vm->core;
+	uint64_t * ccount = (uint64_t*)&core->cyclel;
+	uint32_t elapsedUs = ( vm->lock_time ? *ccount : now ) / vm->time_divisor - vm->last_time;
+	vm->last_time += elapsedUs;
+	if( !vm->lock_time && !vm->slept )
+	{
+		// What actually ran, slices can end early.
+		vm->slice_instrs += *ccount - vm->slice_cycle;
+		vm->slice_time += elapsedUs;
+	}
+	vm->slice_cycle = *ccount;
+
+	MiniRV32IMAVirtioConsolePoll( vm, vm->console );
+	MiniRV32IMAVMUARTPoll( vm );
+	MiniRV32IMAVMUpdateIRQ( vm );
+
+	// Execute up to the next timer interrupt before breaking out.
+	vm->slice = MiniRV32IMAVMInstructionsUntilTimer( vm );
+	if( vm->slice > budget ) vm->slice = budget;
+
+	MiniRV32IMAVMCurrent = vm;
+	vm->reschedule = 0;
+	int32_t ret = vm->step( core, vm->image, 0, elapsedUs, vm->slice );
+	if( vm->reschedule ) ret = 0;
+	vm->slept = ( ret == 1 );
+	switch( ret )
+	{
+		case 0: return MINIRV32_VM_OK;
+		case 1:
+			if( vm->lock_time )
+			{
+				// Time only moves with cycles, so go straight to the interrupt.
+				if( !vm->timer_deadline_cycle ) *ccount += vm->slice;
+				else if( *ccount < vm->timer_deadline_cycle ) *ccount = vm->timer_deadline_cycle;
+			}
+			return MINIRV32_VM_WFI;
+		case 3: return MINIRV32_VM_FAULT;
+		case 0x7777: return MINIRV32_VM_REBOOT; //syscon code for restart
+		case 0x5555: return MINIRV32_VM_POWEROFF; //syscon code for power-off
+		default: return MINIRV32_VM_UNKNOWN;
+	}
+}
+
+MINIRV32_DECORATE uint64_t MiniRV32IMAVMIdleMicroseconds( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAState * core = vm->core;
+	uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+	uint64_t timer = ((uint64_t)core->timerh << 32) | core->timerl;
+	if( vm->lock_time ) return vm->timer_deadline_cycle ? 0 : MINIRV32_VM_MAX_IDLE; // Run already skipped ahead.
+	if( !match ) return MINIRV32_VM_MAX_IDLE;
+	if( timer > match ) return 0;
+	uint64_t us = ( match + 1 - timer ) * vm->time_divisor;
+	return ( us > MINIRV32_VM_MAX_IDLE ) ? MINIRV32_VM_MAX_IDLE : us;
+}
+
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMReadOutput( struct MiniRV32IMAVM * vm, uint8_t * buf, uint32_t len )
+{
+	if( len > vm->output_len ) len = vm->output_len;
+	memcpy( buf, vm->output, len );
+	memmove( vm->output, vm->output + len, vm->output_len - len );
+	vm->output_len -= len;
+	return len;
+}
+
+MINIRV32_DECORATE uint32_t MiniRV32IMAVMWriteInput( struct MiniRV32IMAVM * vm, const uint8_t * buf, uint32_t len )
+{
+	uint32_t i;
+	for( i = 0; i < len && vm->input_head - vm->input_tail < MINIRV32_VM_INPUT_SIZE; i++ )
+		vm->input[vm->input_head++ & ( MINIRV32_VM_INPUT_SIZE - 1 )] = buf[i];
+	return i;
+}
+
+// Next byte of input, or -1.
+static int MiniRV32IMAVMGetInput( struct MiniRV32IMAVM * vm )
+{
+	if( vm->input_head == vm->input_tail )
+	{
+		vm->input_polled = 1;
+		return -1;
+	}
+	return vm->input[vm->input_tail++ & ( MINIRV32_VM_INPUT_SIZE - 1 )];
+}
+
+static void MiniRV32IMAVMPutOutput( struct MiniRV32IMAVM * vm, const char * s, uint32_t len )
+{
+	if( len > MINIRV32_VM_OUTPUT_SIZE - vm->output_len ) len = MINIRV32_VM_OUTPUT_SIZE - vm->output_len;
+	memcpy( vm->output + vm->output_len, s, len );
+	vm->output_len += len;
+}
+
+// Moves input into the receive FIFO, which is one byte deep until FCR enables it.
+static void MiniRV32IMAVMUARTFill( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAVMUART * u = &vm->uart;
+	uint32_t depth = ( u->fcr & 1 ) ? MINIRV32_VM_UART_FIFO : 1;
+	while( u->rx_count < depth && vm->input_head != vm->input_tail )
+		u->rx[( u->rx_head + u->rx_count++ ) & ( MINIRV32_VM_UART_FIFO - 1 )] = vm->input[vm->input_tail++ & ( MINIRV32_VM_INPUT_SIZE - 1 )];
+	if( !u->rx_count )
+		vm->input_polled = 1;
+}
+
+// Before each slice.  A guest waiting on the receive interrupt never reads
+// LSR, so new input has to be brought in here.
+static void MiniRV32IMAVMUARTPoll( struct MiniRV32IMAVM * vm )
+{
+	if( vm->uart.ier & 1 )
+		MiniRV32IMAVMUARTFill( vm );
+}
+
+// Samples every device's interrupt line into the PLIC, and drives MEIP from
+// it.  Called after anything that could change one, returns nonzero if MEIP
+// just went up.
+static int MiniRV32IMAVMUpdateIRQ( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAVMUART * u = &vm->uart;
+	struct MiniRV32IMAVMPLIC * p = &vm->plic;
+	uint32_t level = 0, ready, was = vm->core->mip;
+	int i;
+	if( ( ( u->ier & 1 ) && u->rx_count ) || ( ( u->ier & 2 ) && u->thri ) )
+		level |= 1<<MINIRV32_VM_IRQ_UART;
+	if( vm->blk && vm->blk->interrupt_status )
+		level |= 1<<MINIRV32_VM_IRQ_VIRTIO_BLK;
+	if( vm->console->interrupt_status )
+		level |= 1<<MINIRV32_VM_IRQ_VIRTIO_CONSOLE;
+
+	// A claimed source can't be pending again until it's completed.
+	p->pending |= level & ~p->claimed;
+	ready = p->pending & p->enable;
+	for( i = 1; ready && i < MINIRV32_VM_PLIC_SOURCES; i++ )
+		if( ( ( ready >> i ) & 1 ) && p->priority[i] > p->threshold )
+			break;
+	if( ready && i < MINIRV32_VM_PLIC_SOURCES )
+		vm->core->mip |= 1<<11;
+	else
+		vm->core->mip &= ~(1<<11);
+	return ( vm->core->mip & ~was ) >> 11;
+}
+
+// The pending source with the highest priority, lowest number first, or 0.
+static uint32_t MiniRV32IMAVMPLICClaim( struct MiniRV32IMAVM * vm )
+{
+	struct MiniRV32IMAVMPLIC * p = &vm->plic;
+	uint32_t ready = p->pending & p->enable;
+	uint32_t best = 0, i;
+	for( i = 1; i < MINIRV32_VM_PLIC_SOURCES; i++ )
+		if( ( ( ready >> i ) & 1 ) && p->priority[i] > p->threshold && p->priority[i] > p->priority[best] )
+			best = i;
+	p->pending &= ~( 1u << best );
+	p->claimed |= ( 1u << best ) & ~1u;
+	return best;
+}
+
+// Priorities at 4 * source, pending bits at 0x1000, the context's enables at
+// 0x2000, its threshold at 0x200000 and claim / complete at 0x200004.
+static uint32_t MiniRV32IMAVMPLICLoad( struct MiniRV32IMAVM * vm, uint32_t reg )
+{
+	struct MiniRV32IMAVMPLIC * p = &vm->plic;
+	uint32_t r = 0;
+	if( reg < MINIRV32_VM_PLIC_SOURCES * 4 )
+		r = p->priority[reg / 4];
+	else if( reg == 0x1000 )
+		r = p->pending;
+	else if( reg == 0x2000 )
+		r = p->enable;
+	else if( reg == 0x200000 )
+		r = p->threshold;
+	else if( reg == 0x200004 )
+	{
+		r = MiniRV32IMAVMPLICClaim( vm );
+		MiniRV32IMAVMUpdateIRQ( vm );
+	}
+	return r;
+}
+
+// Returns nonzero if MEIP just went up.
+static int MiniRV32IMAVMPLICStore( struct MiniRV32IMAVM * vm, uint32_t reg, uint32_t val )
+{
+	struct MiniRV32IMAVMPLIC * p = &vm->plic;
+	if( reg < MINIRV32_VM_PLIC_SOURCES * 4 && reg >= 4 )
+		p->priority[reg / 4] = val & 7;
+	else if( reg == 0x2000 )
+		p->enable = val & ~1u;
+	else if( reg == 0x200000 )
+		p->threshold = val & 7;
+	else if( reg == 0x200004 && val < MINIRV32_VM_PLIC_SOURCES )
+		p->claimed &= ~( 1u << val );
+	return MiniRV32IMAVMUpdateIRQ( vm );
+}
+
+static uint32_t MiniRV32IMAVMUARTLoad( struct MiniRV32IMAVM * vm, uint32_t reg )
+{
+	struct MiniRV32IMAVMUART * u = &vm->uart;
+	uint32_t r = 0;
+	switch( reg )
+	{
+		case 0: // RBR, or DLL
+			if( u->lcr & 0x80 ) return u->dll;
+			MiniRV32IMAVMUARTFill( vm );
+			if( u->rx_count )
+			{
+				r = u->rx[u->rx_head++ & ( MINIRV32_VM_UART_FIFO - 1 )];
+				u->rx_count--;
+			}
+			break;
+		case 1: return ( u->lcr & 0x80 ) ? u->dlm : u->ier;
+		case 2: // IIR, received data goes before the transmitter.
+			MiniRV32IMAVMUARTFill( vm );
+			r = ( u->fcr & 1 ) ? 0xc0 : 0;
+			if( ( u->ier & 1 ) && u->rx_count )
+				r |= 0x04;
+			else if( ( u->ier & 2 ) && u->thri )
+			{
+				r |= 0x02;
+				u->thri = 0;
+			}
+			else
+				r |= 0x01;
+			break;
+		case 3: return u->lcr;
+		case 4: return u->mcr;
+		case 5: // LSR, THR and the transmitter are always empty.
+			MiniRV32IMAVMUARTFill( vm );
+			r = 0x60 | !!u->rx_count;
+			break;
+		case 6: return 0xb0; // MSR, DCD, DSR and CTS.
+		case 7: return u->scr;
+	}
+	MiniRV32IMAVMUpdateIRQ( vm );
+	return r;
+}
+
+// Returns nonzero to end the slice.
+static int MiniRV32IMAVMUARTStore( struct MiniRV32IMAVM * vm, uint32_t reg, uint32_t val )
+{
+	struct MiniRV32IMAVMUART * u = &vm->uart;
+	int full = 0;
+	switch( reg )
+	{
+		case 0: // THR, or DLL
+			if( u->lcr & 0x80 )
+			{
+				u->dll = val;
+				break;
+			}
+			{
+				char c = val;
+				MiniRV32IMAVMPutOutput( vm, &c, 1 );
+			}
+			u->thri = 1;
+			// Leave room for a debug CSR print, which can't end the slice itself.
+			full = vm->output_len > MINIRV32_VM_OUTPUT_SIZE - 1024;
+			break;
+		case 1: // IER, or DLM
+			if( u->lcr & 0x80 )
+			{
+				u->dlm = val;
+				break;
+			}
+			// THR is empty, so turning its interrupt on raises it right away.
+			if( val & ~u->ier & 2 ) u->thri = 1;
+			u->ier = val & 0x0f;
+			break;
+		case 2: // FCR, turning the FIFOs on or off empties them.
+			if( ( val & 2 ) || ( ( val ^ u->fcr ) & 1 ) ) u->rx_count = 0;
+			u->fcr = val & 0xc1;
+			break;
+		case 3: u->lcr = val; break;
+		case 4: u->mcr = val & 0x1f; break;
+		case 7: u->scr = val; break;
+	}
+	// Take a new interrupt now, not at the end of the slice.
+	return MiniRV32IMAVMUpdateIRQ( vm ) || full;
+}
+
+static uint32_t MiniRV32IMAVMStore( struct MiniRV32IMAVM * vm, uint32_t addy, uint32_t val )
+{
+	if( addy - 0x10000000 < 8 ) //UART 16550A
+	{
+		if( MiniRV32IMAVMUARTStore( vm, addy - 0x10000000, val ) )
+			return MINIRV32_VM_STEP_RESCHEDULE( vm );
+	}
+	else if( addy == 0x11004004 || addy == 0x11004000 ) //CLNT
+	{
+		if( addy == 0x11004004 )
+			vm->core->timermatchh = val;
+		else
+			vm->core->timermatchl = val;
+		// Plan the next slice around the new deadline.
+		MiniRV32IMAVMUpdateTimerDeadline( vm );
+		return MINIRV32_VM_STEP_RESCHEDULE( vm );
+	}
+	else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
+	{
+		return val;
+	}
+	else if( addy - MINIRV32_VIRTIO_BLK_BASE < MINIRV32_VIRTIO_MMIO_SIZE && vm->blk )
+	{
+		// Requests are done right here, stop if one overwrote code we're running,
+		// or to take the interrupt for it.
+		if( MiniRV32IMAVirtioStore( vm, vm->blk, addy - MINIRV32_VIRTIO_BLK_BASE, val ) | MiniRV32IMAVMUpdateIRQ( vm ) )
+			return MINIRV32_VM_STEP_RESCHEDULE( vm );
+	}
+	else if( addy - MINIRV32_VIRTIO_CONSOLE_BASE < MINIRV32_VIRTIO_MMIO_SIZE )
+	{
+		// Same again, or the output buffer needs emptying.
+		if( MiniRV32IMAVirtioStore( vm, vm->console, addy - MINIRV32_VIRTIO_CONSOLE_BASE, val ) | MiniRV32IMAVMUpdateIRQ( vm ) )
+			return MINIRV32_VM_STEP_RESCHEDULE( vm );
+	}
+	else if( addy - MINIRV32_VM_PLIC_BASE < MINIRV32_VM_PLIC_SIZE )
+	{
+		if( MiniRV32IMAVMPLICStore( vm, addy - MINIRV32_VM_PLIC_BASE, val ) )
+			return MINIRV32_VM_STEP_RESCHEDULE( vm );
+	}
+	return 0;
+}
+
+static uint32_t MiniRV32IMAVMLoad( struct MiniRV32IMAVM * vm, uint32_t addy )
+{
+	if( addy - 0x10000000 < 8 ) //UART 16550A
+		return MiniRV32IMAVMUARTLoad( vm, addy - 0x10000000 );
+	else if( addy == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
+		return vm->core->timerh;
+	else if( addy == 0x1100bff8 )
+		return vm->core->timerl;
+	else if( addy - MINIRV32_VIRTIO_BLK_BASE < MINIRV32_VIRTIO_MMIO_SIZE && vm->blk )
+		return MiniRV32IMAVirtioLoad( vm->blk, addy - MINIRV32_VIRTIO_BLK_BASE );
+	else if( addy - MINIRV32_VIRTIO_CONSOLE_BASE < MINIRV32_VIRTIO_MMIO_SIZE )
+		return MiniRV32IMAVirtioLoad( vm->console, addy - MINIRV32_VIRTIO_CONSOLE_BASE );
+	else if( addy - MINIRV32_VM_PLIC_BASE < MINIRV32_VM_PLIC_SIZE )
+		return MiniRV32IMAVMPLICLoad( vm, addy - MINIRV32_VM_PLIC_BASE );
+	return 0;
+}
+
+static void MiniRV32IMAVMCSRWrite( struct MiniRV32IMAVM * vm, uint16_t csrno, uint32_t value )
+{
+	char buf[32];
+	if( csrno == 0x136 )
+		MiniRV32IMAVMPutOutput( vm, buf, snprintf( buf, sizeof( buf ), "%d", value ) );
+	else if( csrno == 0x137 )
+		MiniRV32IMAVMPutOutput( vm, buf, snprintf( buf, sizeof( buf ), "%08x", value ) );
+	else if( csrno == 0x138 )
+	{
+		// Prints a string from guest RAM, up to 511 bytes of it.
+		uint32_t ptrstart = value - MINIRV32_RAM_IMAGE_OFFSET;
+		uint32_t ptrend = ptrstart;
+		if( ptrstart >= vm->ram_size )
+		{
+			MiniRV32IMAVMPutOutput( vm, "DEBUG PASSED INVALID PTR", 24 );
+			return;
+		}
+		while( ptrend < vm->ram_size && ptrend - ptrstart < 511 && vm->image[ptrend] )
+			ptrend++;
+		MiniRV32IMAVMPutOutput( vm, (const char *)vm->image + ptrstart, ptrend - ptrstart );
+	}
+	else if( csrno == 0x139 )
+	{
+		char c = value;
+		MiniRV32IMAVMPutOutput( vm, &c, 1 );
+	}
+}
+
+static int32_t MiniRV32IMAVMCSRRead( struct MiniRV32IMAVM * vm, uint16_t csrno )
+{
+	if( csrno == 0x140 )
+		return MiniRV32IMAVMGetInput( vm );
+	return 0;
+}
+
+#endif
+
+#endif
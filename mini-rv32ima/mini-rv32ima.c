@@ -5,206 +5,99 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <windows.h>
-#include <ctype.h>
-#include <winuser.h>
 
-#include "default64mbdtc.h"
+#include "mini-rv32ima-fdt.h"
 
 // Just default RAM amount is 64MB.
 uint32_t ram_amt = 64*1024*1024;
 int fail_on_all_faults = 0;
+int time_divisor = 1;
+int fixed_update = 0;
+int huge_pages = 0; // -H, back guest RAM with 2MB pages if we can.
+const char * ram_backing = "4kB pages"; // What AllocateRAM() managed, for -M.
 
-static BOOL IsHover();
 static int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber );
 static uint64_t GetTimeMicroseconds();
 static void ResetKeyboardInput();
 static void CaptureKeyboardInput();
-static uint32_t HandleException( uint32_t ir, uint32_t retval );
-static uint32_t HandleControlStore( uint32_t addy, uint32_t val );
-static uint32_t HandleControlLoad( uint32_t addy );
-static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value );
-static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno );
-static void MiniSleep();
+static void MiniSleep( uint64_t us );
 static int IsKBHit();
 static int ReadKBByte();
 
-// This is the functionality we want to override in the emulator.
-//  think of this as the way the emulator's processor is connected to the outside world.
+// The frontend, the GDI overlay on Windows or the terminal elsewhere.
+static void ConsoleInit();
+static void ConsoleShutdown();
+static void ConsoleWrite( const char * s );
+static void ConsoleSliceDone();
+static void FeedConsole();
+static void DrainConsole();
+
+static uint8_t * AllocateRAM();
+static int ClearRAM();
+static int LoadRAMImage( FILE * f, long flen );
+static FILE * OpenCompressedImage( FILE * f, const char * fname );
+static int StreamRAMImage( FILE * f, uint32_t limit );
+static int SaveSnapshot( const char * fname, int dtb_ptr );
+static int LoadSnapshot( const char * fname, int * dtb_ptr );
+static int ForkVMs( int count );
+static int RunPool( int count, int threads, long long instct );
+static void StartBenchmark();
+static int LoadDefaultDTB();
+#ifdef MINIRV32_DIRTY_PAGES
+static int SaveCheckpoint( const char * fname, int dtb_ptr );
+static int CloseCheckpoints();
+static void PrintWorkingSet();
+#endif
+
+// The emulator's processor and how it's connected to the outside world, the
+// CLINT, syscon and UART, are all in mini-rv32ima-vm.h.  We run one of them.
 #define MINIRV32WARN( x... ) printf( x );
 #define MINIRV32_DECORATE  static
-#define MINI_RV32_RAM_SIZE ram_amt
-#define MINIRV32_IMPLEMENTATION
-#define MINIRV32_POSTEXEC( pc, ir, retval ) { if( retval > 0 ) { if( fail_on_all_faults ) { printf( "FAULT\n" ); return 3; } else retval = HandleException( ir, retval ); } }
-#define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) if( HandleControlStore( addy, val ) ) return val;
-#define MINIRV32_HANDLE_MEM_LOAD_CONTROL( addy, rval ) rval = HandleControlLoad( addy );
-#define MINIRV32_OTHERCSR_WRITE( csrno, value ) HandleOtherCSRWrite( image, csrno, value );
-#define MINIRV32_OTHERCSR_READ( csrno, value ) value = HandleOtherCSRRead( image, csrno );
+#define MINIRV32_VM_IMPLEMENTATION
 
-#include "mini-rv32ima.h"
+#include "mini-rv32ima-vm.h"
+#include "mini-rv32ima-elf.h"
+
+static uint8_t * MapDiskImage( const char * fname, int copy_on_write, uint64_t * size, int * read_only );
+static int FlushDiskImage( struct MiniRV32IMAVirtio * dev );
 
 uint8_t * ram_image = 0;
 struct MiniRV32IMAState * core;
-static HDC g_hdc;
-static int g_line;
-static int g_column;
-static int g_char_width, g_char_height;
-static HFONT g_font;
-static POINT g_cursor;
-// Back-buffer DC and bitmap for fast redraw
-static HDC     g_memdc;
-static HBITMAP g_membmp;
-static int g_screen_width;
-static int g_screen_height;
-static int g_display_width;
-static int g_display_height;
-static int g_max_lines;
-// Overlay text buffer and dimensions
-static char *screen_buf = NULL;
-static int   g_max_cols = 0;
+static struct MiniRV32IMAVM * vm; // Runs on ram_image, so core is vm->core.
 const char * kernel_command_line = 0;
+const char * snapshot_out = 0;
+int fork_count = 0;
+int pool_count = 0, pool_threads = 0; // -P and -j.
+const char * disk_file_name = 0; // -D
+static uint8_t * disk_image;
+static uint64_t disk_size;
+static int disk_read_only;
+static struct MiniRV32IMAVirtio blk;
+long long checkpoint_every = 0; // -K, in instructions.
+#ifdef MINIRV32_DIRTY_PAGES
+static FILE * checkpoint_file; // Open from the first -K checkpoint until we stop.
+static int checkpoint_piped, checkpoint_count;
+static long long since_checkpoint; // Instructions, across reboots too.
+#endif
+static volatile int stop_requested; // Set by Ctrl+C with -S or -F, to stop between slices.
+static uint8_t * snapshot_devices; // From -R, for the VM once it's made.
+static uint32_t snapshot_devices_len;
 
 static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image );
 
-void print_text_gdi(const char *s) {
-    static int ansi_state = 0; // 0=normal,1=seen ESC,2=in CSI
-    for (const char *p = s; *p; p++) {
-        unsigned char c = *p;
-        if (ansi_state == 0) {
-            if (c == '\x1b') { ansi_state = 1; continue; }
-        } else if (ansi_state == 1) {
-            if (c == '[') { ansi_state = 2; continue; }
-            ansi_state = 0;
-            // fallthrough to normal handling of c
-        } else if (ansi_state == 2) {
-            if (c >= 0x40 && c <= 0x7E) ansi_state = 0;
-            continue;
-        }
-        // Skip stray CSI sequences like "[1;30m" when ESC was lost
-        if (ansi_state == 0 && c == '[') {
-            const char *q = p + 1;
-            // scan digits and semicolons
-            while (*q && (isdigit((unsigned char)*q) || *q == ';')) {
-                q++;
-            }
-            // if we find a final byte (0x40–0x7E), skip the whole sequence
-            if (*q && ((unsigned char)*q >= 0x40 && (unsigned char)*q <= 0x7E)) {
-                p = q;
-                continue;
-            }
-        }
-        // Handle backspace
-        if (c == '\b') {
-            if (g_column > 0) {
-                g_column--;
-                // Clear the character cell in back-buffer
-                RECT r = {
-                    g_column * g_char_width,
-                    g_line   * g_char_height,
-                    (g_column + 1) * g_char_width,
-                    (g_line   + 1) * g_char_height
-                };
-                HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
-                FillRect(g_memdc, &r, hbr);
-                // Clear overlay buffer entry
-                screen_buf[g_line * g_max_cols + g_column] = 0;
-            }
-            continue;
-        }
-        // Normal character handling
-        if (c == '\r') {
-            g_column = 0;
-            continue;
-        } else if (c == '\n') {
-            g_line++;
-            g_column = 0;
-            if (g_line >= g_max_lines) {
-                int sh = g_char_height;
-                BitBlt(g_memdc, 0, 0, g_screen_width, g_screen_height - sh, g_memdc, 0, sh, SRCCOPY);
-                RECT r = {0, g_screen_height - sh, g_screen_width, g_screen_height};
-                HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
-                FillRect(g_memdc, &r, hbr);
-                g_line = g_max_lines - 1;
-            }
-        } else {
-            // Wrap on width overflow
-            int max_cols = g_screen_width / g_char_width;
-            if (g_column >= max_cols) {
-                g_line++;
-                g_column = 0;
-                if (g_line >= g_max_lines) {
-                    int sh = g_char_height;
-                    BitBlt(g_memdc, 0, 0, g_screen_width, g_screen_height - sh,
-                           g_memdc, 0, sh, SRCCOPY);
-                    RECT r = {0, g_screen_height - sh, g_screen_width, g_screen_height};
-                    HBRUSH hbr = (HBRUSH)GetStockObject(BLACK_BRUSH);
-                    FillRect(g_memdc, &r, hbr);
-                    g_line = g_max_lines - 1;
-                }
-            }
-            // Draw character
-            // Record character in overlay buffer
-            screen_buf[g_line * g_max_cols + g_column] = c;
-            TextOutA(g_memdc,
-                     g_column * g_char_width,
-                     g_line * g_char_height,
-                     (LPCSTR)&c, 1);
-            g_column++;
-        }
-    }
-}
-
 int main( int argc, char ** argv )
 {
-    g_hdc = GetDC(NULL);
-    // Select the system OEM fixed-pitch font
-    g_font = CreateFont(12, 6, 0, 0, FW_DONTCARE, FALSE, FALSE, FALSE, DEFAULT_CHARSET, OUT_OUTLINE_PRECIS,
-                CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, VARIABLE_PITCH, TEXT("SimSun"));
-    SelectObject(g_hdc, g_font);
-    SetBkMode(g_hdc, TRANSPARENT);
-    SetTextColor(g_hdc, RGB(255,255,255));
-    // Clear entire screen to black
-    SetBkColor(g_hdc, RGB(0,0,0));
-    // Text background remains black
-    SetBkMode(g_hdc, OPAQUE);
-    // Query actual character cell size
-    {
-        TEXTMETRICA tm;
-        GetTextMetricsA(g_hdc, &tm);
-        g_char_width  = tm.tmAveCharWidth;
-        g_char_height = tm.tmHeight - tm.tmInternalLeading;
-    }
-    g_display_width  = GetDeviceCaps(g_hdc, HORZRES);
-    g_display_height = GetDeviceCaps(g_hdc, VERTRES);
-    g_screen_width = g_display_width / 3;
-    g_screen_height = g_display_height / 3;
-    g_max_lines     = g_screen_height / g_char_height;
-    // Initialize overlay buffer
-    g_max_cols  = g_screen_width / g_char_width;
-    screen_buf  = calloc(g_max_lines * g_max_cols, 1);
-    // Create back-buffer DC and bitmap
-    g_memdc  = CreateCompatibleDC(g_hdc);
-    g_membmp = CreateCompatibleBitmap(g_hdc, g_screen_width, g_screen_height);
-    SelectObject(g_memdc, g_membmp);
-    // Mirror text settings into back-buffer DC
-    SelectObject(g_memdc, g_font);
-    SetBkMode(g_memdc, OPAQUE);
-    SetTextColor(g_memdc, RGB(255,255,255));
-    SetBkColor(g_memdc, RGB(0,0,0));
-    // Clear back-buffer to black
-    PatBlt(g_memdc, 0, 0, g_screen_width, g_screen_height, BLACKNESS);
-    g_line = 0;
-    g_column = 0;
 	int i;
 	long long instct = -1;
 	int show_help = 0;
-	int time_divisor = 1;
-	int fixed_update = 0;
 	int do_sleep = 1;
 	int single_step = 0;
+	int benchmark = 0;
 	int dtb_ptr = 0;
+	uint32_t image_entry = MINIRV32_RAM_IMAGE_OFFSET;
 	const char * image_file_name = 0;
 	const char * dtb_file_name = 0;
+	const char * snapshot_in = 0;
 	for( i = 1; i < argc; i++ )
 	{
 		const char * param = argv[i];
@@ -220,6 +113,15 @@ int main( int argc, char ** argv )
 				case 'k': if( ++i < argc ) kernel_command_line = argv[i]; break;
 				case 'f': image_file_name = (++i<argc)?argv[i]:0; break;
 				case 'b': dtb_file_name = (++i<argc)?argv[i]:0; break;
+				case 'S': snapshot_out = (++i<argc)?argv[i]:0; break;
+				case 'R': snapshot_in = (++i<argc)?argv[i]:0; break;
+				case 'F': if( ++i < argc ) fork_count = SimpleReadNumberInt( argv[i], 0 ); break;
+				case 'P': if( ++i < argc ) pool_count = SimpleReadNumberInt( argv[i], 0 ); break;
+				case 'j': if( ++i < argc ) pool_threads = SimpleReadNumberInt( argv[i], 0 ); break;
+				case 'D': disk_file_name = (++i<argc)?argv[i]:0; break;
+				case 'K': if( ++i < argc ) checkpoint_every = SimpleReadNumberInt( argv[i], 0 ); break;
+				case 'H': param_continue = 1; huge_pages = 1; break;
+				case 'M': param_continue = 1; benchmark = 1; break;
 				case 'l': param_continue = 1; fixed_update = 1; break;
 				case 'p': param_continue = 1; do_sleep = 0; break;
 				case 's': param_continue = 1; single_step = 1; break;
@@ -241,20 +143,50 @@ int main( int argc, char ** argv )
 			param++;
 		} while( param_continue );
 	}
-	if( show_help || image_file_name == 0 || time_divisor <= 0 )
+	if( show_help || ( image_file_name == 0 && snapshot_in == 0 ) || time_divisor <= 0 || ( checkpoint_every && !snapshot_out ) || ( pool_count && ( snapshot_out || fork_count || single_step ) ) )
 	{
-		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n" );
+		fprintf( stderr, "./mini-rv32imaf [parameters]\n\t-m [ram amount]\n\t-f [running image, flat or ELF, may be gzip, zstd or lz4 compressed]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time divion base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n\t-S [file] save a snapshot when stopped by -c or Ctrl+C (.gz to compress)\n\t-R [file] boot from a snapshot instead of an image\n\t-F [count] when stopped like -S, fork count copies of the VM, logging to vm<n>.log\n\t-K [count] with -S, also checkpoint every count instructions, appending only the pages that changed\n\t-H back RAM with 2MB huge pages\n\t-M on exit, print run time and host dTLB misses\n\t-P [count] run count copies of the VM on a pool of threads, logging to vm<n>.log, -c per copy\n\t-j [threads] for -P, default one per CPU\n\t-D [file] virtio block device on file, copy on write with -F or -P\n" );
 		return 1;
 	}
+#ifndef MINIRV32_DIRTY_PAGES
+	if( checkpoint_every )
+	{
+		fprintf( stderr, "Error: -K needs a build with MINIRV32_DIRTY_PAGES\n" );
+		return 1;
+	}
+#endif
+
+	ConsoleInit();
+
+	// -F and -P copies can't all write to the same file, each gets its own
+	// copy-on-write view of it.  -P maps one per copy.
+	if( disk_file_name && !( disk_image = MapDiskImage( disk_file_name, fork_count || pool_count, &disk_size, &disk_read_only ) ) )
+	{
+		fprintf( stderr, "Error: Could not map disk image \"%s\"\n", disk_file_name );
+		return -5;
+	}
 
-	ram_image = malloc( ram_amt );
-	if( !ram_image )
+	// With -R, RAM is as big as the snapshot says.
+	if( !snapshot_in )
 	{
-		fprintf( stderr, "Error: could not allocate system image.\n" );
-		return -4;
+		ram_image = AllocateRAM();
+		if( !ram_image )
+		{
+			fprintf( stderr, "Error: could not allocate system image.\n" );
+			return -4;
+		}
 	}
 
 restart:
+	if( snapshot_in )
+	{
+		if( LoadSnapshot( snapshot_in, &dtb_ptr ) )
+		{
+			fprintf( stderr, "Error: Could not restore snapshot \"%s\"\n", snapshot_in );
+			return -10;
+		}
+	}
+	else
 	{
 		FILE * f = fopen( image_file_name, "rb" );
 		if( !f || ferror( f ) )
@@ -262,20 +194,41 @@ restart:
 			fprintf( stderr, "Error: \"%s\" not found\n", image_file_name );
 			return -5;
 		}
-		fseek( f, 0, SEEK_END );
-		long flen = ftell( f );
-		fseek( f, 0, SEEK_SET );
-		if( flen > ram_amt )
+		// A compressed image is read straight from the decompressor into RAM
+		// once the DTB is in place, without a temporary file.
+		FILE * stream = OpenCompressedImage( f, image_file_name );
+		if( stream )
 		{
-			fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
-			return -6;
+			if( ClearRAM() )
+			{
+				fprintf( stderr, "Error: Could not load image.\n" );
+				return -7;
+			}
 		}
-
-		memset( ram_image, 0, ram_amt );
-		if( fread( ram_image, flen, 1, f ) != 1)
+		else if( IsELF( f ) )
 		{
-			fprintf( stderr, "Error: Could not load image.\n" );
-			return -7;
+			if( ClearRAM() || !( image_entry = LoadELF( f, ram_image, ram_amt ) ) )
+			{
+				fprintf( stderr, "Error: Could not load ELF \"%s\"\n", image_file_name );
+				return -7;
+			}
+		}
+		else
+		{
+			fseek( f, 0, SEEK_END );
+			long flen = ftell( f );
+			fseek( f, 0, SEEK_SET );
+			if( flen > ram_amt )
+			{
+				fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
+				return -6;
+			}
+
+			if( LoadRAMImage( f, flen ) )
+			{
+				fprintf( stderr, "Error: Could not load image.\n" );
+				return -7;
+			}
 		}
 		fclose( f );
 
@@ -307,76 +260,159 @@ restart:
 		}
 		else
 		{
-			// Load a default dtb.
-			dtb_ptr = ram_amt - sizeof(default64mbdtb) - sizeof( struct MiniRV32IMAState );
-			memcpy( ram_image + dtb_ptr, default64mbdtb, sizeof( default64mbdtb ) );
-			if( kernel_command_line )
+			// Build one for this much RAM and this command line.
+			dtb_ptr = LoadDefaultDTB();
+			if( dtb_ptr < 0 )
 			{
-				strncpy( (char*)( ram_image + dtb_ptr + 0xc0 ), kernel_command_line, 54 );
+				fprintf( stderr, "Error: Could not build dtb\n" );
+				return -9;
 			}
 		}
-	}
 
-	CaptureKeyboardInput();
+		if( stream )
+		{
+			int bad = StreamRAMImage( stream, dtb_ptr ? dtb_ptr : ram_amt );
+			if( pclose( stream ) || bad )
+			{
+				fprintf( stderr, "Error: Could not decompress \"%s\" into %d bytes of RAM\n", image_file_name, dtb_ptr ? dtb_ptr : ram_amt );
+				return -6;
+			}
+		}
+	}
 
-	// The core lives at the end of RAM.
-	core = (struct MiniRV32IMAState *)(ram_image + ram_amt - sizeof( struct MiniRV32IMAState ));
-	core->pc = MINIRV32_RAM_IMAGE_OFFSET;
-	core->regs[10] = 0x00; //hart ID
-	core->regs[11] = dtb_ptr?(dtb_ptr+MINIRV32_RAM_IMAGE_OFFSET):0; //dtb_pa (Must be valid pointer) (Should be pointer to dtb)
-	core->extraflags |= 3; // Machine-mode.
+	// With -R, this is the first we know how much RAM there is.
+	if( !vm )
+	{
+		vm = MiniRV32IMAVMCreate( ram_amt, ram_image );
+		if( !vm )
+		{
+			fprintf( stderr, "Error: could not allocate VM.\n" );
+			return -4;
+		}
+		vm->fail_on_all_faults = fail_on_all_faults;
+		vm->time_divisor = time_divisor;
+		vm->lock_time = fixed_update;
+		core = vm->core;
+		if( disk_image )
+		{
+			MiniRV32IMAVirtioBlockInit( &blk, disk_image, disk_size, disk_read_only, ( fork_count || pool_count ) ? 0 : FlushDiskImage );
+			vm->blk = &blk;
+		}
+	}
 
-	if( dtb_file_name == 0 )
+	// The core lives at the end of RAM.  A snapshot already has it set up, and
+	// the devices, which don't, come with it.
+	if( snapshot_in )
 	{
-		// Update system ram size in DTB (but if and only if we're using the default DTB)
-		// Warning - this will need to be updated if the skeleton DTB is ever modified.
-		uint32_t * dtb = (uint32_t*)(ram_image + dtb_ptr);
-		if( dtb[0x13c/4] == 0x00c0ff03 )
+		MiniRV32IMAVMFlush( vm );
+		if( MiniRV32IMAVMLoadDevices( vm, snapshot_devices, snapshot_devices_len ) )
 		{
-			uint32_t validram = dtb_ptr;
-			dtb[0x13c/4] = (validram>>24) | ((( validram >> 16 ) & 0xff) << 8 ) | (((validram>>8) & 0xff ) << 16 ) | ( ( validram & 0xff) << 24 );
+			fprintf( stderr, "Error: Snapshot \"%s\" has different devices, check -D\n", snapshot_in );
+			return -10;
 		}
 	}
+	else
+		MiniRV32IMAVMBoot( vm, image_entry, dtb_ptr?(dtb_ptr+MINIRV32_RAM_IMAGE_OFFSET):0 );
+#ifdef MINIRV32_DIRTY_PAGES
+	// All of RAM was just rewritten behind the core's back.  Once we've started
+	// checkpointing, the next one has to carry it all.
+	MiniRV32IMASetDirtyPages( vm->dirty, ( ram_amt + 4095 ) / 4096, checkpoint_count != 0 );
+#endif
+#ifdef MINIRV32_PAGE_ATTRS
+	MiniRV32IMAResetPageAttrs( vm->pageattrs, ram_amt );
+#endif
+
+	CaptureKeyboardInput();
+
+	if( benchmark )
+		StartBenchmark();
+
+	if( pool_count )
+	{
+		int ret = RunPool( pool_count, pool_threads, instct );
+		ConsoleShutdown();
+		return ret;
+	}
 
 	// Image is loaded.
+run:;
 	uint64_t rt;
-	uint64_t lastTime = (fixed_update)?0:(GetTimeMicroseconds()/time_divisor);
-	int instrs_per_flip = single_step?1:1024;
-	for( rt = 0; rt < instct+1 || instct < 0; rt += instrs_per_flip )
-	{
-		uint64_t * this_ccount = ((uint64_t*)&core->cyclel);
-		uint32_t elapsedUs = 0;
-		if( fixed_update )
-			elapsedUs = *this_ccount / time_divisor - lastTime;
-		else
-			elapsedUs = GetTimeMicroseconds()/time_divisor - lastTime;
-		lastTime += elapsedUs;
-
+	MiniRV32IMAVMStart( vm, GetTimeMicroseconds() );
+	// The VM stops at the next timer interrupt by itself, rt counts what it was allowed.
+	for( rt = 0; rt < instct+1 || instct < 0; rt += vm->slice )
+	{
 		if( single_step )
 			DumpState( core, ram_image);
 
-		int ret = MiniRV32IMAStep( core, ram_image, 0, elapsedUs, instrs_per_flip ); // Execute upto 1024 cycles before breaking out.
+		uint32_t budget = single_step ? 1 : MINIRV32_VM_MAX_SLICE;
+		if( instct >= 0 && budget > instct + 1 - rt ) budget = instct + 1 - rt;
+
+		// Only bother looking at the keyboard once the guest has.
+		if( vm->input_polled )
+			FeedConsole();
+		int ret = MiniRV32IMAVMRun( vm, budget, fixed_update ? 0 : GetTimeMicroseconds() );
+		DrainConsole();
 		switch( ret )
 		{
-			case 0: break;
-			case 1: if( do_sleep ) MiniSleep(); *this_ccount += instrs_per_flip; break;
-			case 3: instct = 0; break;
-			case 0x7777: goto restart;	//syscon code for restart
-			case 0x5555: { char buf[64]; snprintf(buf, sizeof(buf), "POWEROFF@0x%08x%08x", core->cycleh, core->cyclel); print_text_gdi(buf); return 0; } //syscon code for power-off
-            default: print_text_gdi( "Unknown failure\n" ); break;
+			case MINIRV32_VM_OK: break;
+			case MINIRV32_VM_WFI: // Nothing to do until the timer fires or a key is pressed.
+			{
+				uint64_t idle = MiniRV32IMAVMIdleMicroseconds( vm );
+				if( do_sleep && idle ) MiniSleep( idle );
+				break;
+			}
+			case MINIRV32_VM_FAULT: ConsoleWrite( "FAULT\n" ); instct = 0; break;
+			case MINIRV32_VM_REBOOT: goto restart;
+			case MINIRV32_VM_POWEROFF: { char buf[64]; snprintf(buf, sizeof(buf), "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel); ConsoleWrite(buf);
+#ifdef MINIRV32_PAIR_HISTOGRAM
+				MiniRV32IMAPrintPairHistogram( 40 );
+#endif
+#ifdef MINIRV32_DIRTY_PAGES
+				PrintWorkingSet();
+				CloseCheckpoints();
+#endif
+				ConsoleShutdown();
+				return 0; }
+			default: ConsoleWrite( "Unknown failure\n" ); break;
 		}
 
-        while(!IsHover())
-            Sleep(1);
-    }
+		if( stop_requested ) break;
+#ifdef MINIRV32_DIRTY_PAGES
+		since_checkpoint += vm->slice;
+		if( checkpoint_every && since_checkpoint >= checkpoint_every )
+		{
+			since_checkpoint = 0;
+			if( SaveCheckpoint( snapshot_out, dtb_ptr ) )
+				fprintf( stderr, "Error: Could not save checkpoint to \"%s\"\n", snapshot_out );
+		}
+#endif
+		ConsoleSliceDone();
+	}
 
-    DeleteObject(g_font);
-    ReleaseDC(NULL, g_hdc);
-    // Destroy back-buffer
-    DeleteObject(g_membmp);
-    DeleteDC(g_memdc);
-    free(screen_buf);
-    DumpState( core, ram_image);
+	DumpState( core, ram_image);
+#ifdef MINIRV32_PAIR_HISTOGRAM
+	MiniRV32IMAPrintPairHistogram( 40 );
+#endif
+#ifdef MINIRV32_DIRTY_PAGES
+	// With -K, the final state goes on the end of the other checkpoints.
+	if( checkpoint_every && ( SaveCheckpoint( snapshot_out, dtb_ptr ) | CloseCheckpoints() ) )
+		fprintf( stderr, "Error: Could not save checkpoint to \"%s\"\n", snapshot_out );
+	if( !checkpoint_every )
+		PrintWorkingSet();
+#endif
+	if( snapshot_out && !checkpoint_every && SaveSnapshot( snapshot_out, dtb_ptr ) )
+		fprintf( stderr, "Error: Could not save snapshot \"%s\"\n", snapshot_out );
+	if( fork_count && ForkVMs( fork_count ) )
+	{
+		// We're one of the copies, run until poweroff.
+		instct = -1;
+		fork_count = 0;
+		snapshot_out = 0;
+		checkpoint_every = 0;
+		stop_requested = 0;
+		goto run;
+	}
+	ConsoleShutdown();
 }
 
 
@@ -386,102 +422,7 @@ restart:
 
 
 #if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
-#include <string.h>
-// Buffered GetAsyncKeyState for keyboard input
-static int  g_kbPending = 0;
-static int  g_kbValue   = -1;
-
-static BOOL IsHover()
-{
-    POINT cursor_pos;
-    GetCursorPos(&cursor_pos);
-    if (cursor_pos.x > g_display_width - g_screen_width && cursor_pos.y < g_screen_height)
-        return TRUE;
-    else
-        return FALSE;
-}
-
-static void CaptureKeyboardInput()
-{
-    // No initialization needed for polling
-}
-
-static void ResetKeyboardInput()
-{
-    // No cleanup needed
-}
-
-static void MiniSleep()
-{
-    // Idle sleep, drawing occurs in main loop via back-buffer blit
-        // Blit back-buffer to desktop DC each iteration
-    if (IsHover())
-        BitBlt(g_hdc, g_display_width - g_screen_width, 0, g_screen_width, g_screen_height,
-                g_memdc, 0, 0, SRCCOPY);
-}
-
-static uint64_t GetTimeMicroseconds()
-{
-    static LARGE_INTEGER lpf;
-    LARGE_INTEGER li;
-    if (!lpf.QuadPart)
-        QueryPerformanceFrequency(&lpf);
-    QueryPerformanceCounter(&li);
-    return ((uint64_t)li.QuadPart * 1000000LL) / (uint64_t)lpf.QuadPart;
-}
-
-static int IsKBHit()
-{
-    if (g_kbPending)
-        return 1;
-    for (int vk = 8; vk < 256; vk++) {
-        // Skip pure SHIFT keys so they don't register as input
-        if (vk == VK_SHIFT || vk == VK_LSHIFT || vk == VK_RSHIFT)
-            continue;
-        if (GetAsyncKeyState(vk) & 1 && IsHover()) {
-            // Handle '-'/'_' key explicitly
-            if (vk == VK_OEM_MINUS) {
-                g_kbValue = (GetAsyncKeyState(VK_SHIFT) & 0x8000) ? '_' : '-';
-            } else {
-                BYTE ks[256];
-                GetKeyboardState(ks);
-                // Mark SHIFT in key state
-                if (GetAsyncKeyState(VK_SHIFT) & 0x8000)
-                    ks[VK_SHIFT] |= 0x80;
-                UINT scan = MapVirtualKeyA(vk, MAPVK_VK_TO_VSC);
-                WCHAR bufUni[4];
-                int len = ToUnicodeEx(
-                    vk, scan, ks, bufUni, 4, 0, GetKeyboardLayout(0)
-                );
-                if (len > 0) {
-                    g_kbValue = (int)bufUni[0];
-                } else {
-                    switch (vk) {
-                        case VK_LEFT:  g_kbValue = '\b'; break;
-                        case VK_RIGHT: g_kbValue = '\t'; break;
-                        case VK_UP:    g_kbValue = '\x1B'; break;
-                        case VK_DOWN:  g_kbValue = '\n'; break;
-                        default:       g_kbValue = -1; break;
-                    }
-                }
-            }
-            g_kbPending = 1;
-            return 1;
-        }
-        // Redraw overlay buffer to desktop DC each iteration
-    }
-    return 0;
-}
-
-static int ReadKBByte()
-{
-    if (!g_kbPending)
-        return -1;
-    int c = g_kbValue;
-    g_kbPending = 0;
-    return c;
-}
-
+#include "mini-rv32ima-gdi.h"
 #else
 
 #include <sys/ioctl.h>
@@ -489,9 +430,29 @@ static int ReadKBByte()
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "mini-rv32ima-pool.h"
 
 static void CtrlC()
 {
+	// With -S or -F, finish the current slice first so there's something consistent to save or fork.
+	if( ( snapshot_out || fork_count ) && !stop_requested )
+	{
+		stop_requested = 1;
+		return;
+	}
 	DumpState( core, ram_image);
 	exit( 0 );
 }
@@ -518,9 +479,461 @@ static void ResetKeyboardInput()
 	tcsetattr(0, TCSANOW, &term);
 }
 
-static void MiniSleep()
+// With -H, RAM is 2MB aligned, so guest and host 2MB boundaries line up, and
+// backed by explicit huge pages from the hugetlbfs pool if there are enough.
+// If not, we ask for transparent ones.
+#define HUGE_PAGE_SIZE ( 2 * 1024 * 1024 )
+static int ram_hugetlb;
+
+static uint32_t RAMMapSize()
+{
+	return huge_pages ? ( ram_amt + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ) : ram_amt;
+}
+
+static void AdviseHugePages()
+{
+#ifdef MADV_HUGEPAGE
+	if( huge_pages && !ram_hugetlb && madvise( ram_image, RAMMapSize(), MADV_HUGEPAGE ) == 0 )
+		ram_backing = "transparent 2MB pages";
+#endif
+}
+
+// Guest RAM is mapped, not allocated, so pages the guest never touches cost
+// nothing, and the image is mapped copy-on-write rather than read in.
+static uint8_t * AllocateRAM()
+{
+	uint32_t len = RAMMapSize();
+	uint8_t * ram;
+	if( !huge_pages )
+	{
+		ram = mmap( 0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		return ( ram == MAP_FAILED ) ? 0 : ram;
+	}
+#ifdef MAP_HUGETLB
+	// Reserved up front, so a short pool means falling back now, not SIGBUS later.
+	ram = mmap( 0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	if( ram != MAP_FAILED )
+	{
+		ram_hugetlb = 1;
+		ram_backing = "explicit 2MB pages";
+		return ram;
+	}
+#endif
+	// Map 2MB more than we need, and trim it to an aligned window.
+	uint8_t * base = mmap( 0, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( base == MAP_FAILED )
+		return 0;
+	ram = (uint8_t*)( ( (uintptr_t)base + HUGE_PAGE_SIZE - 1 ) & ~(uintptr_t)( HUGE_PAGE_SIZE - 1 ) );
+	if( ram != base )
+		munmap( base, ram - base );
+	munmap( ram + len, base + HUGE_PAGE_SIZE - ram );
+	return ram;
+}
+
+// Puts the image at the start of freshly cleared RAM.  On reboot, mapping fresh
+// pages over RAM drops whatever the last boot dirtied without touching the rest.
+static int ClearRAM()
+{
+	if( ram_hugetlb )
+	{
+		// Remapping would have to get the whole pool again, and it's all in use anyway.
+		memset( ram_image, 0, ram_amt );
+		return 0;
+	}
+	if( mmap( ram_image, RAMMapSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0 ) == MAP_FAILED )
+		return -1;
+	AdviseHugePages();
+	return 0;
+}
+
+static int LoadRAMImage( FILE * f, long flen )
+{
+	if( ClearRAM() )
+		return -1;
+	// The file's pages would be 4kB, so with -H it gets copied in.
+	if( flen && !huge_pages && mmap( ram_image, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno( f ), 0 ) != MAP_FAILED )
+		return 0;
+	// Not something we can map, i.e. a pipe.
+	return fread( ram_image, flen, 1, f ) != 1;
+}
+
+// Fork server.  Every copy shares the pages nobody has written to yet, so this
+// is cheap however big RAM is.  Returns 1 in each child, with the UART going to
+// vm<n>.log and no keyboard, or 0 in the parent once they've all exited.
+static int ForkVMs( int count )
+{
+	int i;
+	// The I/O thread doesn't survive a fork, each child starts its own.
+	ConsoleShutdown();
+	fflush( stdout );
+	for( i = 0; i < count; i++ )
+	{
+		pid_t pid = fork();
+		if( pid == 0 )
+		{
+			char name[32];
+			snprintf( name, sizeof( name ), "vm%d.log", i );
+			if( !freopen( name, "w", stdout ) || !freopen( "/dev/null", "r", stdin ) )
+				exit( -1 );
+			ConsoleInit();
+			return 1;
+		}
+		if( pid < 0 )
+		{
+			fprintf( stderr, "Error: Could only fork %d VMs\n", i );
+			break;
+		}
+	}
+	while( wait( 0 ) > 0 );
+	return 0;
+}
+
+// -P, count copies of the VM as it is now, all in this process on a pool of
+// threads.  Each has its own RAM, with just the nonzero pages copied in, and
+// logs to vm<n>.log.  Unlike -F, they can't share pages, but there can be far
+// more of them than there are processes to go around.
+static void PoolOutput( void * user, const uint8_t * buf, uint32_t len )
+{
+	fwrite( buf, 1, len, (FILE *)user );
+}
+
+static void PoolDone( void * user, struct MiniRV32IMAVM * vm, int why )
+{
+	static const char * const names[] = { "STOPPED", "WFI", "POWEROFF", "REBOOT", "FAULT", "UNKNOWN" };
+	fprintf( (FILE *)user, "%s@0x%08x%08x\n", names[why], vm->core->cycleh, vm->core->cyclel );
+	fclose( (FILE *)user );
+}
+
+static int RunPool( int count, int threads, long long instct )
+{
+	static const uint8_t zero[4096];
+	struct MiniRV32IMAVM ** vms = calloc( count, sizeof( struct MiniRV32IMAVM * ) );
+	struct MiniRV32IMAVirtio * blks = calloc( count, sizeof( struct MiniRV32IMAVirtio ) );
+	// The devices start out as ours, booted or from -R, like RAM does.
+	uint32_t devices_len = MiniRV32IMAVMSaveDevices( vm, 0, 0 );
+	uint8_t * devices = malloc( devices_len );
+	struct MiniRV32IMAPool * pool;
+	uint32_t ofs;
+	int i, ret = 0;
+
+	if( threads <= 0 ) threads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( threads > count ) threads = count;
+	pool = MiniRV32IMAPoolCreate( threads, count, PoolOutput, PoolDone );
+	if( !vms || !blks || !devices || !pool )
+	{
+		fprintf( stderr, "Error: could not allocate pool of %d VMs\n", count );
+		free( vms );
+		free( blks );
+		free( devices );
+		MiniRV32IMAPoolDestroy( pool );
+		return -4;
+	}
+	MiniRV32IMAVMSaveDevices( vm, devices, devices_len );
+
+	for( i = 0; i < count; i++ )
+	{
+		char name[32];
+		snprintf( name, sizeof( name ), "vm%d.log", i );
+		FILE * log = fopen( name, "w" );
+		if( !log || !( vms[i] = MiniRV32IMAVMCreate( ram_amt, 0 ) ) )
+		{
+			fprintf( stderr, "Error: Could only create %d VMs\n", i );
+			if( log ) fclose( log );
+			break;
+		}
+		for( ofs = 0; ofs < ram_amt; ofs += sizeof( zero ) )
+		{
+			uint32_t len = ( ram_amt - ofs < sizeof( zero ) ) ? ram_amt - ofs : sizeof( zero );
+			if( memcmp( ram_image + ofs, zero, len ) ) memcpy( vms[i]->image + ofs, ram_image + ofs, len );
+		}
+		vms[i]->fail_on_all_faults = fail_on_all_faults;
+		vms[i]->time_divisor = time_divisor;
+		vms[i]->lock_time = fixed_update;
+		if( disk_image )
+		{
+			// Each its own copy-on-write disk, but the first can have ours.
+			uint64_t size = disk_size;
+			int read_only = disk_read_only;
+			uint8_t * view = i ? MapDiskImage( disk_file_name, 1, &size, &read_only ) : disk_image;
+			if( !view )
+			{
+				fprintf( stderr, "Error: Could not map disk image \"%s\" for VM %d\n", disk_file_name, i );
+				MiniRV32IMAVMDestroy( vms[i] );
+				vms[i] = 0;
+				fclose( log );
+				break;
+			}
+			MiniRV32IMAVirtioBlockInit( &blks[i], view, size, read_only, 0 );
+			vms[i]->blk = &blks[i];
+		}
+		MiniRV32IMAVMLoadDevices( vms[i], devices, devices_len );
+		MiniRV32IMAVMStart( vms[i], MiniRV32IMAPoolTime() );
+		MiniRV32IMAPoolAdd( pool, vms[i], ( instct < 0 ) ? ~0ULL : instct, log );
+	}
+
+	(void)MiniRV32IMAPoolInput; // They get no input, like -F's copies.
+
+	uint64_t start = GetTimeMicroseconds();
+	if( MiniRV32IMAPoolRun( pool ) )
+	{
+		fprintf( stderr, "Error: Could not start %d threads\n", threads );
+		ret = -1;
+	}
+	double seconds = ( GetTimeMicroseconds() - start ) / 1000000.0;
+	fprintf( stderr, "Pool: %d VMs on %d threads, %llu instructions in %.3f s (%.1f MIPS)\n",
+		pool->count, threads, (unsigned long long)pool->instructions, seconds, pool->instructions / seconds / 1000000.0 );
+
+	MiniRV32IMAPoolDestroy( pool );
+	for( i = 0; i < count; i++ )
+	{
+		if( i && blks[i].disk ) munmap( blks[i].disk, disk_size );
+		MiniRV32IMAVMDestroy( vms[i] );
+	}
+	free( blks );
+	free( vms );
+	free( devices );
+	return ret;
+}
+
+// -D, the disk is mapped rather than read in, so only what the guest touches
+// is ever loaded.  Falls back to read only if the file isn't writable.
+static uint8_t * MapDiskImage( const char * fname, int copy_on_write, uint64_t * size, int * read_only )
+{
+	struct stat st;
+	int fd = open( fname, copy_on_write ? O_RDONLY : O_RDWR );
+	*read_only = 0;
+	if( fd < 0 && !copy_on_write )
+	{
+		fd = open( fname, O_RDONLY );
+		*read_only = 1;
+	}
+	if( fd < 0 ) return 0;
+	if( fstat( fd, &st ) || st.st_size < 512 || (size_t)st.st_size != st.st_size )
+	{
+		close( fd );
+		return 0;
+	}
+	// A private mapping can be written even if the file can't.
+	void * disk = mmap( 0, st.st_size, *read_only ? PROT_READ : PROT_READ | PROT_WRITE, copy_on_write ? MAP_PRIVATE : MAP_SHARED, fd, 0 );
+	close( fd );
+	if( disk == MAP_FAILED ) return 0;
+	*size = st.st_size;
+	return disk;
+}
+
+static int FlushDiskImage( struct MiniRV32IMAVirtio * dev )
+{
+	return msync( dev->disk, dev->disk_size, MS_SYNC );
+}
+
+// -M, for comparing -H against plain 4kB pages.  The dTLB misses come from
+// perf counters, so need Linux and a perf_event_paranoid that allows them.
+static uint64_t benchmark_start;
+static int tlb_counters[2] = { -1, -1 }; // Load misses, store misses.
+
+static void ReportBenchmark()
+{
+	uint64_t misses[2] = { 0, 0 };
+	int i;
+	fprintf( stderr, "Benchmark: %.3f s, %llu guest instructions, RAM on %s\n",
+		( GetTimeMicroseconds() - benchmark_start ) / 1000000.0, (unsigned long long)( ((uint64_t)core->cycleh << 32) | core->cyclel ), ram_backing );
+	for( i = 0; i < 2; i++ )
+		if( tlb_counters[i] < 0 || read( tlb_counters[i], &misses[i], sizeof( misses[i] ) ) != sizeof( misses[i] ) )
+			break;
+	if( i == 2 )
+		fprintf( stderr, "Benchmark: %llu dTLB load misses, %llu dTLB store misses\n", (unsigned long long)misses[0], (unsigned long long)misses[1] );
+	else
+		fprintf( stderr, "Benchmark: dTLB miss counters not available\n" );
+}
+
+static void StartBenchmark()
+{
+	if( benchmark_start ) return; // Already counting from before a reboot.
+#ifdef __linux__
+	int i;
+	for( i = 0; i < 2; i++ )
+	{
+		struct perf_event_attr pe;
+		memset( &pe, 0, sizeof( pe ) );
+		pe.size = sizeof( pe );
+		pe.type = PERF_TYPE_HW_CACHE;
+		pe.config = PERF_COUNT_HW_CACHE_DTLB | ( ( i ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ ) << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		tlb_counters[i] = syscall( __NR_perf_event_open, &pe, 0, -1, -1, 0 );
+	}
+#endif
+	benchmark_start = GetTimeMicroseconds();
+	atexit( ReportBenchmark );
+}
+
+// The terminal is read and written by a thread of its own, so the CPU thread
+// never makes a syscall for console I/O.  Each direction is a ring with one
+// producer, which only moves head, and one consumer, which only moves tail.
+#define CONSOLE_OUT_SIZE 65536 // Both must be powers of two.
+#define CONSOLE_IN_SIZE 4096
+#define CONSOLE_FLUSH_US 5000 // Output goes out in one write at least this often.
+
+struct ConsoleRing
+{
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t size;
+	uint8_t * buf;
+};
+
+static uint8_t console_out_buf[CONSOLE_OUT_SIZE];
+static uint8_t console_in_buf[CONSOLE_IN_SIZE];
+static struct ConsoleRing console_out = { 0, 0, CONSOLE_OUT_SIZE, console_out_buf };
+static struct ConsoleRing console_in = { 0, 0, CONSOLE_IN_SIZE, console_in_buf };
+static pthread_t console_thread;
+static int console_running;
+static int console_stop;   // Tells the thread to write what's left and exit.
+static int console_eof;    // stdin has nothing more for us.
+static int console_fd;     // Where output goes, stdout when ConsoleInit() was called.
+static int console_wake[2] = { -1, -1 }; // A pipe, so MiniSleep() can wait for input.
+
+// Returns how many of the len bytes fit.
+static uint32_t ConsoleRingPush( struct ConsoleRing * r, const uint8_t * s, uint32_t len )
+{
+	uint32_t head = r->head;
+	uint32_t space = r->size - ( head - __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE ) );
+	uint32_t i;
+	if( len > space ) len = space;
+	for( i = 0; i < len; i++ )
+		r->buf[( head + i ) & ( r->size - 1 )] = s[i];
+	__atomic_store_n( &r->head, head + len, __ATOMIC_RELEASE );
+	return len;
+}
+
+// Returns how many bytes it took, up to len.
+static uint32_t ConsoleRingPop( struct ConsoleRing * r, uint8_t * d, uint32_t len )
 {
-	usleep(500);
+	uint32_t tail = r->tail;
+	uint32_t avail = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) - tail;
+	uint32_t i;
+	if( len > avail ) len = avail;
+	for( i = 0; i < len; i++ )
+		d[i] = r->buf[( tail + i ) & ( r->size - 1 )];
+	__atomic_store_n( &r->tail, tail + len, __ATOMIC_RELEASE );
+	return len;
+}
+
+// Writes out everything in console_out, straight from the ring.
+static void ConsoleFlushOut()
+{
+	uint32_t tail = console_out.tail;
+	uint32_t head = __atomic_load_n( &console_out.head, __ATOMIC_ACQUIRE );
+	while( tail != head )
+	{
+		uint32_t ofs = tail & ( CONSOLE_OUT_SIZE - 1 );
+		uint32_t len = head - tail;
+		if( len > CONSOLE_OUT_SIZE - ofs ) len = CONSOLE_OUT_SIZE - ofs;
+		ssize_t w = write( console_fd, console_out_buf + ofs, len );
+		if( w < 0 && errno == EINTR ) continue;
+		tail += ( w < 0 ) ? len : w; // If it can't be written, drop it.
+		__atomic_store_n( &console_out.tail, tail, __ATOMIC_RELEASE );
+	}
+}
+
+static void * ConsoleThread( void * unused )
+{
+	uint8_t buf[CONSOLE_IN_SIZE];
+	(void)unused;
+	for( ;; )
+	{
+		int stop = __atomic_load_n( &console_stop, __ATOMIC_ACQUIRE );
+		ConsoleFlushOut();
+		if( stop ) return 0;
+
+		// Only read what there's room for, the rest waits in the kernel.
+		uint32_t room = CONSOLE_IN_SIZE - ( console_in.head - __atomic_load_n( &console_in.tail, __ATOMIC_ACQUIRE ) );
+		struct pollfd pfd = { 0, POLLIN, 0 };
+		int nfds = ( room && !console_eof ) ? 1 : 0;
+		if( poll( &pfd, nfds, CONSOLE_FLUSH_US / 1000 ) <= 0 || !nfds )
+			continue;
+		ssize_t r = read( 0, buf, room );
+		if( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
+			continue;
+		if( r <= 0 )
+			__atomic_store_n( &console_eof, 1, __ATOMIC_RELEASE );
+		else
+			ConsoleRingPush( &console_in, buf, r );
+		// If the pipe is full, MiniSleep() has been woken already.
+		if( write( console_wake[1], "", 1 ) < 0 ) continue;
+	}
+}
+
+static void ConsoleInit()
+{
+	static int hooked;
+	sigset_t all, old;
+	if( console_running ) return;
+	console_out.head = console_out.tail = console_in.head = console_in.tail = 0;
+	console_stop = console_eof = 0;
+	console_fd = fileno( stdout );
+	if( pipe( console_wake ) )
+		console_wake[0] = console_wake[1] = -1;
+	fcntl( console_wake[0], F_SETFL, O_NONBLOCK );
+	fcntl( console_wake[1], F_SETFL, O_NONBLOCK );
+
+	// Ctrl+C has to land on the CPU thread, which is the only one allowed to write.
+	sigfillset( &all );
+	pthread_sigmask( SIG_BLOCK, &all, &old );
+	console_running = !pthread_create( &console_thread, 0, ConsoleThread, 0 );
+	pthread_sigmask( SIG_SETMASK, &old, 0 );
+
+	// So output isn't lost if we exit() from anywhere.
+	if( !hooked ) atexit( ConsoleShutdown );
+	hooked = 1;
+}
+
+static void ConsoleShutdown()
+{
+	if( !console_running ) return;
+	__atomic_store_n( &console_stop, 1, __ATOMIC_RELEASE );
+	pthread_join( console_thread, 0 );
+	console_running = 0;
+	close( console_wake[0] );
+	close( console_wake[1] );
+	console_wake[0] = console_wake[1] = -1;
+}
+
+static void ConsoleWrite( const char * s )
+{
+	uint32_t len = strlen( s );
+	if( !console_running )
+	{
+		fputs( s, stdout );
+		return;
+	}
+	// If the terminal can't keep up, we have to wait for it.
+	for( ;; )
+	{
+		uint32_t done = ConsoleRingPush( &console_out, (const uint8_t *)s, len );
+		s += done;
+		len -= done;
+		if( !len ) break;
+		usleep( CONSOLE_FLUSH_US );
+	}
+}
+
+// Called between time slices.  Nothing to do, the I/O thread flushes output
+// by itself.
+static void ConsoleSliceDone()
+{
+}
+
+// Sleeps for up to us microseconds, or until the I/O thread has read some input.
+static void MiniSleep( uint64_t us )
+{
+	struct timeval tv = { us / 1000000, us % 1000000 };
+	char drain[64];
+	fd_set fds;
+	FD_ZERO( &fds );
+	if( console_wake[0] >= 0 ) FD_SET( console_wake[0], &fds );
+	if( select( console_wake[0] + 1, &fds, 0, 0, &tv ) > 0 )
+		while( read( console_wake[0], drain, sizeof( drain ) ) > 0 );
 }
 
 static uint64_t GetTimeMicroseconds()
@@ -530,27 +943,20 @@ static uint64_t GetTimeMicroseconds()
 	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
 }
 
-static int is_eofd;
-
+// Both just look at what the I/O thread has already read.
 static int ReadKBByte()
 {
-	if( is_eofd ) return 0xffffffff;
-	char rxchar = 0;
-	int rread = read(fileno(stdin), (char*)&rxchar, 1);
-
-	if( rread > 0 ) // Tricky: getchar can't be used with arrow keys.
+	uint8_t rxchar;
+	if( ConsoleRingPop( &console_in, &rxchar, 1 ) )
 		return rxchar;
-	else
-		return -1;
+	return -1;
 }
 
 static int IsKBHit()
 {
-	if( is_eofd ) return -1;
-	int byteswaiting;
-	ioctl(0, FIONREAD, &byteswaiting);
-	if( !byteswaiting && write( fileno(stdin), 0, 0 ) != 0 ) { is_eofd = 1; return -1; } // Is end-of-file for 
-	return !!byteswaiting;
+	if( console_in.tail != __atomic_load_n( &console_in.head, __ATOMIC_ACQUIRE ) )
+		return 1;
+	return __atomic_load_n( &console_eof, __ATOMIC_ACQUIRE ) ? -1 : 0;
 }
 
 
@@ -561,105 +967,403 @@ static int IsKBHit()
 // Rest of functions functionality
 //////////////////////////////////////////////////////////////////////////
 
-static uint32_t HandleException( uint32_t ir, uint32_t code )
+// Hands keyboard input to the guest's UART, as much as it has room for.  The
+// rest stays with the keyboard until the guest reads some.
+static void FeedConsole()
 {
-	// Weird opcode emitted by duktape on exit.
-	if( code == 3 )
+	vm->input_polled = 0;
+	while( vm->input_head - vm->input_tail < MINIRV32_VM_INPUT_SIZE && IsKBHit() > 0 )
 	{
-		// Could handle other opcodes here.
+		int c = ReadKBByte();
+		uint8_t b = c;
+		if( c < 0 ) break;
+		MiniRV32IMAVMWriteInput( vm, &b, 1 );
 	}
-	return code;
 }
 
-static uint32_t HandleControlStore( uint32_t addy, uint32_t val )
+// Prints what the guest wrote to the UART since last time.
+static void DrainConsole()
+{
+	char buf[MINIRV32_VM_OUTPUT_SIZE + 1];
+	uint32_t len = MiniRV32IMAVMReadOutput( vm, (uint8_t*)buf, MINIRV32_VM_OUTPUT_SIZE );
+	char * p;
+	buf[len] = 0;
+	// Any NULs the guest wrote are skipped.
+	for( p = buf; p < buf + len; p += strlen( p ) + 1 )
+		ConsoleWrite( p );
+}
+
+// A snapshot is a header, then each nonzero page of RAM as ( page number, page ),
+// then 0xffffffff.  The core, and with it the CLINT, lives at the end of RAM.
+// The UART, PLIC, virtio devices and their buffers don't, so they follow as a
+// length and what MiniRV32IMAVMSaveDevices() gives.  Checkpoints from -K may
+// come after, each as SNAPSHOT_DELTA, the pages that changed since the one
+// before and the devices, in the same form.  Names ending in .gz go through
+// gzip.
+#define SNAPSHOT_MAGIC 0x70616e73 // "snap"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_PAGE 4096
+#define SNAPSHOT_MAX_DEVICES 65536 // Sanity limit on the device state's length.
+#define SNAPSHOT_DELTA 0x61746c64 // "dlta", starts each checkpoint appended with -K.
+
+// Runs cmd, which has one %s for fname, with fname quoted so the shell takes it
+// as it is.  Returns 0 if the command doesn't fit.
+static FILE * PopenFile( const char * cmd, const char * fname, const char * mode )
 {
-	if( addy == 0x10000000 ) //UART 8250 / 16550 Data Buffer
+	char quoted[1024];
+	char line[1100];
+	size_t q = 0;
+#if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
+	// cmd.exe only knows double quotes, and they can't be in a file name.
+	if( strchr( fname, '"' ) ) return 0;
+	quoted[q++] = '"';
+	for( ; *fname && q < sizeof( quoted ) - 2; fname++ )
+		quoted[q++] = *fname;
+	quoted[q++] = '"';
+#else
+	// Single quotes keep everything, a single quote itself becomes '\''.
+	quoted[q++] = '\'';
+	for( ; *fname && q < sizeof( quoted ) - 5; fname++ )
 	{
-        {
-            char cbuf[2] = { (char)val, '\0' };
-            print_text_gdi(cbuf);
-        }
+		if( *fname == '\'' )
+		{
+			memcpy( quoted + q, "'\\''", 4 );
+			q += 4;
+		}
+		else
+			quoted[q++] = *fname;
 	}
-	else if( addy == 0x11004004 ) //CLNT
-		core->timermatchh = val;
-	else if( addy == 0x11004000 ) //CLNT
-		core->timermatchl = val;
-	else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
+	quoted[q++] = '\'';
+#endif
+	quoted[q] = 0;
+	if( *fname || snprintf( line, sizeof( line ), cmd, quoted ) >= (int)sizeof( line ) )
+		return 0;
+	return popen( line, mode );
+}
+
+static FILE * OpenSnapshot( const char * fname, const char * mode, int * piped )
+{
+	size_t len = strlen( fname );
+	*piped = len > 3 && strcmp( fname + len - 3, ".gz" ) == 0;
+	if( !*piped )
+		return fopen( fname, ( mode[0] == 'w' ) ? "wb" : "rb" );
+	return PopenFile( ( mode[0] == 'w' ) ? "gzip -c > %s" : "gzip -dc %s", fname, mode );
+}
+
+static int CloseSnapshot( FILE * f, int piped )
+{
+	return piped ? pclose( f ) : fclose( f );
+}
+
+// Writes out each nonzero page, or with dirty, each page marked in it, then the end marker.
+static int WriteSnapshotPages( FILE * f, const uint32_t * dirty )
+{
+	static const uint8_t zero[SNAPSHOT_PAGE];
+	uint32_t page, end = 0xffffffff;
+	int ok = 1;
+	for( page = 0; ok && page * SNAPSHOT_PAGE < ram_amt; page++ )
 	{
-		core->pc = core->pc + 4;
-		return val; // NOTE: PC will be PC of Syscon.
+		uint32_t ofs = page * SNAPSHOT_PAGE;
+		uint32_t len = ( ram_amt - ofs < SNAPSHOT_PAGE ) ? ram_amt - ofs : SNAPSHOT_PAGE;
+		if( dirty ? !( ( dirty[page>>5] >> ( page & 31 ) ) & 1 ) : memcmp( ram_image + ofs, zero, len ) == 0 ) continue;
+		ok = fwrite( &page, sizeof( page ), 1, f ) == 1 && fwrite( ram_image + ofs, len, 1, f ) == 1;
 	}
-	return 0;
+	return ok && fwrite( &end, sizeof( end ), 1, f ) == 1;
 }
 
+static int ReadSnapshotPages( FILE * f )
+{
+	uint32_t page;
+	int ok;
+	while( ( ok = fread( &page, sizeof( page ), 1, f ) == 1 ) && page != 0xffffffff )
+	{
+		uint32_t ofs = page * SNAPSHOT_PAGE;
+		uint32_t len = ( ram_amt - ofs < SNAPSHOT_PAGE ) ? ram_amt - ofs : SNAPSHOT_PAGE;
+		if( !( ok = ofs < ram_amt && fread( ram_image + ofs, len, 1, f ) == 1 ) ) break;
+	}
+	return ok;
+}
 
-static uint32_t HandleControlLoad( uint32_t addy )
+static int WriteSnapshotDevices( FILE * f )
 {
-	// Emulating a 8250 / 16550 UART
-	if( addy == 0x10000005 )
-		return 0x60 | IsKBHit();
-	else if( addy == 0x10000000 && IsKBHit() )
-		return ReadKBByte();
-	else if( addy == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
-		return core->timerh;
-	else if( addy == 0x1100bff8 )
-		return core->timerl;
-	return 0;
+	uint32_t len = MiniRV32IMAVMSaveDevices( vm, 0, 0 );
+	uint8_t * buf = malloc( len );
+	int ok = buf && MiniRV32IMAVMSaveDevices( vm, buf, len ) == len &&
+		fwrite( &len, sizeof( len ), 1, f ) == 1 && fwrite( buf, len, 1, f ) == 1;
+	free( buf );
+	return ok;
 }
 
-static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
-{
-    char buf[512];
-    if (csrno == 0x136)
-    {
-        snprintf(buf, sizeof(buf), "%d", value);
-        print_text_gdi(buf);
-    }
-    else if (csrno == 0x137)
-    {
-        snprintf(buf, sizeof(buf), "%08x", value);
-        print_text_gdi(buf);
-    }
-    else if (csrno == 0x138)
-    {
-        uint32_t ptrstart = value - MINIRV32_RAM_IMAGE_OFFSET;
-        uint32_t ptrend = ptrstart;
-        if (ptrstart >= ram_amt)
-        {
-            print_text_gdi("DEBUG PASSED INVALID PTR");
-        }
-        else
-        {
-            while (ptrend < ram_amt && image[ptrend])
-                ptrend++;
-            size_t len = ptrend - ptrstart;
-            if (len > 0)
-            {
-                size_t copylen = len < sizeof(buf) - 1 ? len : sizeof(buf) - 1;
-                memcpy(buf, image + ptrstart, copylen);
-                buf[copylen] = '\0';
-                print_text_gdi(buf);
-            }
-        }
-    }
-    else if (csrno == 0x139)
-    {
-        buf[0] = (char)value;
-        buf[1] = '\0';
-        print_text_gdi(buf);
-    }
-}
-
-static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno )
-{
-	if( csrno == 0x140 )
-	{
-		if( !IsKBHit() ) return -1;
-		return ReadKBByte();
+// Keeps the devices in snapshot_devices, the VM might not be made yet.
+static int ReadSnapshotDevices( FILE * f )
+{
+	uint32_t len;
+	if( fread( &len, sizeof( len ), 1, f ) != 1 || !len || len > SNAPSHOT_MAX_DEVICES ) return 0;
+	uint8_t * buf = realloc( snapshot_devices, len );
+	if( !buf ) return 0;
+	snapshot_devices = buf;
+	snapshot_devices_len = len;
+	return fread( buf, len, 1, f ) == 1;
+}
+
+// Images compressed with gzip, zstd or lz4 are piped through the decompressor.
+// Returns the pipe, or 0 if f isn't compressed.
+static FILE * OpenCompressedImage( FILE * f, const char * fname )
+{
+	static const struct { uint8_t magic[4]; const char * cmd; } formats[] = {
+		{ { 0x1f, 0x8b, 0x08 }, "gzip -dc %s" }, // Only the first three bytes are checked for gzip.
+		{ { 0x28, 0xb5, 0x2f, 0xfd }, "zstd -dc %s" },
+		{ { 0x04, 0x22, 0x4d, 0x18 }, "lz4 -dc %s" },
+	};
+	uint8_t magic[4] = { 0 };
+	int i;
+	int got = fread( magic, 1, 4, f );
+	fseek( f, 0, SEEK_SET );
+	for( i = 0; i < sizeof( formats ) / sizeof( formats[0] ); i++ )
+	{
+		if( got < 3 || memcmp( magic, formats[i].magic, ( i == 0 ) ? 3 : 4 ) ) continue;
+		return PopenFile( formats[i].cmd, fname, "r" );
 	}
 	return 0;
 }
 
+// Reads all of f into the start of RAM, failing if there's more than limit bytes.
+static int StreamRAMImage( FILE * f, uint32_t limit )
+{
+	size_t got = fread( ram_image, 1, limit, f );
+	if( got == limit && fgetc( f ) != EOF )
+		return -1;
+	return ferror( f ) ? -1 : 0;
+}
+
+static int SaveSnapshot( const char * fname, int dtb_ptr )
+{
+	uint32_t header[4] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, ram_amt, dtb_ptr };
+	int piped;
+	FILE * f = OpenSnapshot( fname, "w", &piped );
+	if( !f ) return -1;
+
+	int ok = fwrite( header, sizeof( header ), 1, f ) == 1 && WriteSnapshotPages( f, 0 ) && WriteSnapshotDevices( f );
+	return ( CloseSnapshot( f, piped ) || !ok ) ? -1 : 0;
+}
+
+static int LoadSnapshot( const char * fname, int * dtb_ptr )
+{
+	uint32_t header[4];
+	uint32_t delta;
+	int piped;
+	FILE * f = OpenSnapshot( fname, "r", &piped );
+	if( !f ) return -1;
+
+	int ok = fread( header, sizeof( header ), 1, f ) == 1 && header[0] == SNAPSHOT_MAGIC && header[1] == SNAPSHOT_VERSION;
+	if( ok && !ram_image )
+	{
+		ram_amt = header[2];
+		ram_image = AllocateRAM();
+	}
+	ok = ok && ram_image && header[2] == ram_amt && !ClearRAM() && ReadSnapshotPages( f ) && ReadSnapshotDevices( f );
+	// Then any checkpoints appended with -K, to end up at the latest.
+	while( ok && fread( &delta, sizeof( delta ), 1, f ) == 1 )
+		ok = delta == SNAPSHOT_DELTA && ReadSnapshotPages( f ) && ReadSnapshotDevices( f );
+	*dtb_ptr = ok ? header[3] : 0;
+	return ( CloseSnapshot( f, piped ) || !ok ) ? -1 : 0;
+}
+
+#ifdef MINIRV32_DIRTY_PAGES
+
+// With -K, the first checkpoint is a full snapshot, and each one after it is
+// appended as SNAPSHOT_DELTA and just the pages written since the one before.
+static int SaveCheckpoint( const char * fname, int dtb_ptr )
+{
+	int ok;
+	// The core lives in RAM, but isn't written through the memory bus.
+	MiniRV32IMAMarkDirty( vm->dirty, ram_amt - sizeof( struct MiniRV32IMAState ), sizeof( struct MiniRV32IMAState ) );
+	if( !checkpoint_file )
+	{
+		uint32_t header[4] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, ram_amt, dtb_ptr };
+		checkpoint_file = OpenSnapshot( fname, "w", &checkpoint_piped );
+		if( !checkpoint_file ) return -1;
+		ok = fwrite( header, sizeof( header ), 1, checkpoint_file ) == 1 && WriteSnapshotPages( checkpoint_file, 0 ) && WriteSnapshotDevices( checkpoint_file );
+	}
+	else
+	{
+		uint32_t delta = SNAPSHOT_DELTA;
+		ok = fwrite( &delta, sizeof( delta ), 1, checkpoint_file ) == 1 && WriteSnapshotPages( checkpoint_file, vm->dirty ) && WriteSnapshotDevices( checkpoint_file );
+	}
+	fprintf( stderr, "Checkpoint %d: ", checkpoint_count );
+	PrintWorkingSet();
+	checkpoint_count++;
+	MiniRV32IMASetDirtyPages( vm->dirty, ( ram_amt + SNAPSHOT_PAGE - 1 ) / SNAPSHOT_PAGE, 0 );
+#ifdef MINIRV32_PAGE_ATTRS
+	MiniRV32IMAResetPageAttrs( vm->pageattrs, ram_amt );
+#endif
+	return ( fflush( checkpoint_file ) || !ok ) ? -1 : 0;
+}
+
+static int CloseCheckpoints()
+{
+	int ret = checkpoint_file ? CloseSnapshot( checkpoint_file, checkpoint_piped ) : 0;
+	checkpoint_file = 0;
+	return ret;
+}
+
+// How much of RAM the guest has written to, i.e. its working set.
+static void PrintWorkingSet()
+{
+	uint32_t pages = ( ram_amt + SNAPSHOT_PAGE - 1 ) / SNAPSHOT_PAGE;
+	uint32_t dirty = MiniRV32IMACountDirtyPages( vm->dirty, pages );
+	fprintf( stderr, "%u of %u pages (%u kB) written since %s\n", dirty, pages, dirty * ( SNAPSHOT_PAGE / 1024 ), checkpoint_count ? "the last checkpoint" : "boot" );
+}
+
+#endif
+
+// What sixtyfourmb.dts describes, with the memory size and bootargs filled in.
+// Anything else the host emulates should get its node here.
+static void BuildDTB( struct FDT * fdt, uint32_t memsize )
+{
+	static const char clint_compatible[] = "sifive,clint0\0riscv,clint0";
+	static const char plic_compatible[] = "sifive,plic-1.0.0\0riscv,plic0";
+	// phandles
+	const uint32_t cpu0 = 1, cpu0_intc = 2, plic = 3, syscon = 4;
+
+	FDTBeginNode( fdt, "" );
+	FDTPropU32( fdt, "#address-cells", 2 );
+	FDTPropU32( fdt, "#size-cells", 2 );
+	FDTPropString( fdt, "compatible", "riscv-minimal-nommu" );
+	FDTPropString( fdt, "model", "riscv-minimal-nommu,qemu" );
+
+	FDTBeginNode( fdt, "chosen" );
+	FDTPropString( fdt, "bootargs", kernel_command_line ? kernel_command_line : "earlycon=uart8250,mmio,0x10000000,1000000 console=ttyS0" );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "memory@80000000" );
+	FDTPropString( fdt, "device_type", "memory" );
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, MINIRV32_RAM_IMAGE_OFFSET, 0, memsize }, 4 );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "cpus" );
+	FDTPropU32( fdt, "#address-cells", 1 );
+	FDTPropU32( fdt, "#size-cells", 0 );
+	FDTPropU32( fdt, "timebase-frequency", 1000000 );
+	FDTBeginNode( fdt, "cpu@0" );
+	FDTPropU32( fdt, "phandle", cpu0 );
+	FDTPropString( fdt, "device_type", "cpu" );
+	FDTPropU32( fdt, "reg", 0 );
+	FDTPropString( fdt, "status", "okay" );
+	FDTPropString( fdt, "compatible", "riscv" );
+	FDTPropString( fdt, "riscv,isa", "rv32ima" );
+	FDTPropString( fdt, "mmu-type", "riscv,none" );
+	FDTBeginNode( fdt, "interrupt-controller" );
+	FDTPropU32( fdt, "#interrupt-cells", 1 );
+	FDTPropEmpty( fdt, "interrupt-controller" );
+	FDTPropString( fdt, "compatible", "riscv,cpu-intc" );
+	FDTPropU32( fdt, "phandle", cpu0_intc );
+	FDTEndNode( fdt );
+	FDTEndNode( fdt );
+	FDTBeginNode( fdt, "cpu-map" );
+	FDTBeginNode( fdt, "cluster0" );
+	FDTBeginNode( fdt, "core0" );
+	FDTPropU32( fdt, "cpu", cpu0 );
+	FDTEndNode( fdt );
+	FDTEndNode( fdt );
+	FDTEndNode( fdt );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "soc" );
+	FDTPropU32( fdt, "#address-cells", 2 );
+	FDTPropU32( fdt, "#size-cells", 2 );
+	FDTPropString( fdt, "compatible", "simple-bus" );
+	FDTPropEmpty( fdt, "ranges" );
+
+	FDTBeginNode( fdt, "uart@10000000" );
+	FDTPropU32( fdt, "clock-frequency", 0x1000000 );
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, 0x10000000, 0, 0x100 }, 4 );
+	FDTPropString( fdt, "compatible", "ns16550a" );
+	FDTPropU32( fdt, "interrupt-parent", plic );
+	FDTPropU32( fdt, "interrupts", MINIRV32_VM_IRQ_UART );
+	FDTEndNode( fdt );
+
+	// For console=hvc0, the same input and output as the UART, a buffer at a time.
+	FDTBeginNode( fdt, "virtio@10002000" ); // MINIRV32_VIRTIO_CONSOLE_BASE
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, MINIRV32_VIRTIO_CONSOLE_BASE, 0, MINIRV32_VIRTIO_MMIO_SIZE }, 4 );
+	FDTPropString( fdt, "compatible", "virtio,mmio" );
+	FDTPropU32( fdt, "interrupt-parent", plic );
+	FDTPropU32( fdt, "interrupts", MINIRV32_VM_IRQ_VIRTIO_CONSOLE );
+	FDTEndNode( fdt );
+
+	if( disk_file_name )
+	{
+		FDTBeginNode( fdt, "virtio@10001000" ); // MINIRV32_VIRTIO_BLK_BASE
+		FDTPropCells( fdt, "reg", (uint32_t[]){ 0, MINIRV32_VIRTIO_BLK_BASE, 0, MINIRV32_VIRTIO_MMIO_SIZE }, 4 );
+		FDTPropString( fdt, "compatible", "virtio,mmio" );
+		FDTPropU32( fdt, "interrupt-parent", plic );
+		FDTPropU32( fdt, "interrupts", MINIRV32_VM_IRQ_VIRTIO_BLK );
+		FDTEndNode( fdt );
+	}
+
+	FDTBeginNode( fdt, "poweroff" );
+	FDTPropU32( fdt, "value", 0x5555 );
+	FDTPropU32( fdt, "offset", 0 );
+	FDTPropU32( fdt, "regmap", syscon );
+	FDTPropString( fdt, "compatible", "syscon-poweroff" );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "reboot" );
+	FDTPropU32( fdt, "value", 0x7777 );
+	FDTPropU32( fdt, "offset", 0 );
+	FDTPropU32( fdt, "regmap", syscon );
+	FDTPropString( fdt, "compatible", "syscon-reboot" );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "syscon@11100000" );
+	FDTPropU32( fdt, "phandle", syscon );
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, 0x11100000, 0, 0x1000 }, 4 );
+	FDTPropString( fdt, "compatible", "syscon" );
+	FDTEndNode( fdt );
+
+	// Device interrupts, to the hart's machine external interrupt.
+	FDTBeginNode( fdt, "interrupt-controller@10400000" ); // MINIRV32_VM_PLIC_BASE
+	FDTPropU32( fdt, "phandle", plic );
+	FDTPropU32( fdt, "#address-cells", 0 );
+	FDTPropU32( fdt, "#interrupt-cells", 1 );
+	FDTPropEmpty( fdt, "interrupt-controller" );
+	FDTProp( fdt, "compatible", plic_compatible, sizeof( plic_compatible ) );
+	FDTPropCells( fdt, "interrupts-extended", (uint32_t[]){ cpu0_intc, 11 }, 2 );
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, MINIRV32_VM_PLIC_BASE, 0, MINIRV32_VM_PLIC_SIZE }, 4 );
+	FDTPropU32( fdt, "riscv,ndev", MINIRV32_VM_PLIC_SOURCES - 1 );
+	FDTEndNode( fdt );
+
+	FDTBeginNode( fdt, "clint@11000000" );
+	FDTPropCells( fdt, "interrupts-extended", (uint32_t[]){ cpu0_intc, 3, cpu0_intc, 7 }, 4 ); // Software and timer interrupts.
+	FDTPropCells( fdt, "reg", (uint32_t[]){ 0, 0x11000000, 0, 0x10000 }, 4 );
+	FDTProp( fdt, "compatible", clint_compatible, sizeof( clint_compatible ) );
+	FDTEndNode( fdt );
+
+	FDTEndNode( fdt );
+	FDTEndNode( fdt );
+}
+
+// Puts the tree just under the core at the end of RAM, and gives the guest all
+// the RAM below it.  Returns where it went, or -1.
+static int LoadDefaultDTB()
+{
+	struct FDT fdt = { 0 };
+	BuildDTB( &fdt, 0 ); // Just to see how big it is.
+	uint32_t dtblen = FDTSize( &fdt );
+	FDTFree( &fdt );
+	if( !dtblen || dtblen + sizeof( struct MiniRV32IMAState ) + 16 > ram_amt )
+		return -1;
+
+	int dtb_ptr = ( ram_amt - sizeof( struct MiniRV32IMAState ) - dtblen ) & ~15;
+	BuildDTB( &fdt, dtb_ptr );
+	if( FDTSize( &fdt ) == dtblen )
+		FDTWrite( &fdt, ram_image + dtb_ptr );
+	else
+		dtb_ptr = -1;
+	FDTFree( &fdt );
+	return dtb_ptr;
+}
+
 static int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber )
 {
 	if( !number || !number[0] ) return defaultNumber;
@@ -693,22 +1397,27 @@ static void DumpState(struct MiniRV32IMAState *core, uint8_t *ram_image)
     uint32_t ir = 0;
     if (pc_offset < ram_amt - 3)
         ir = *((uint32_t*)(&((uint8_t*)ram_image)[pc_offset]));
-    snprintf(buf, sizeof(buf), "PC: %08x [%s] ", pc, (pc_offset < ram_amt - 3) ? "0x" : "xxxx", 0);
+    snprintf(buf, sizeof(buf), "PC: %08x [%s] ", pc, (pc_offset < ram_amt - 3) ? "0x" : "xxxx");
     if (pc_offset < ram_amt - 3)
-        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%08x", ir);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%08x ", ir);
     else
-        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "xxxxxxxxxx");
-    print_text_gdi(buf);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "xxxxxxxxxx ");
+    // Symbolize, if we booted an ELF.
+    uint32_t symofs;
+    const char *sym = LookupELFSymbol(pc, &symofs);
+    if (sym)
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "<%s+0x%x> ", sym, symofs);
+    ConsoleWrite(buf);
     uint32_t *regs = core->regs;
     snprintf(buf, sizeof(buf),
-        "Z:%08x ra:%08x sp:%08x gp:%08x tp:%08x t0:%08x t1:%08x t2:%08x s0:%08x s1:%08x a0:%08x a1:%08x a2:%08x a3:%08x a4:%08x a5:%08x",
+        "Z:%08x ra:%08x sp:%08x gp:%08x tp:%08x t0:%08x t1:%08x t2:%08x s0:%08x s1:%08x a0:%08x a1:%08x a2:%08x a3:%08x a4:%08x a5:%08x\n",
         regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6], regs[7],
         regs[8], regs[9], regs[10], regs[11], regs[12], regs[13], regs[14], regs[15]);
-    print_text_gdi(buf);
+    ConsoleWrite(buf);
     snprintf(buf, sizeof(buf),
-        "a6:%08x a7:%08x s2:%08x s3:%08x s4:%08x s5:%08x s6:%08x s7:%08x s8:%08x s9:%08x s10:%08x s11:%08x t3:%08x t4:%08x t5:%08x t6:%08x",
+        "a6:%08x a7:%08x s2:%08x s3:%08x s4:%08x s5:%08x s6:%08x s7:%08x s8:%08x s9:%08x s10:%08x s11:%08x t3:%08x t4:%08x t5:%08x t6:%08x\n",
         regs[16], regs[17], regs[18], regs[19], regs[20], regs[21], regs[22], regs[23],
         regs[24], regs[25], regs[26], regs[27], regs[28], regs[29], regs[30], regs[31]);
-    print_text_gdi(buf);
+    ConsoleWrite(buf);
 }
 
@@ -18,6 +18,7 @@
 		* There is a dedicated CLNT at 0x10000000.
 		* There is free MMIO from there to 0x12000000.
 		* You can put things like a UART, or whatever there.
+		* Devices interrupt by setting bit 11 (MEIP) of mip between steps.
 		* Feel free to override any of the functionality with macros.
 */
 
@@ -57,10 +58,26 @@
 	#define MINIRV32_OTHERCSR_READ(...);
 #endif
 
+// How the interpreter picks the code for each instruction.  Which one is
+// fastest depends on your compiler and CPU.
+#define MINIRV32_DISPATCH_SWITCH 0 // One big switch.
+#define MINIRV32_DISPATCH_GOTO   1 // Computed goto, GCC and clang only.
+#define MINIRV32_DISPATCH_CALL   2 // Call through a table of handler functions.
+
+#ifndef MINIRV32_DISPATCH
+	#define MINIRV32_DISPATCH MINIRV32_DISPATCH_SWITCH
+#endif
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
+#if defined( MINIRV32_DIRTY_PAGES ) && !defined( MINIRV32_PAGE_ATTRS ) // With page attributes, only stores taking the slow way mark pages.
+	#define MINIRV32_STORE4( ofs, val ) ( MiniRV32IMAMarkDirty( MINIRV32_DIRTY_BITMAP, ofs, 4 ), *(uint32_t*)(image + ofs) = val )
+	#define MINIRV32_STORE2( ofs, val ) ( MiniRV32IMAMarkDirty( MINIRV32_DIRTY_BITMAP, ofs, 2 ), *(uint16_t*)(image + ofs) = val )
+	#define MINIRV32_STORE1( ofs, val ) ( MiniRV32IMAMarkDirty( MINIRV32_DIRTY_BITMAP, ofs, 1 ), *(uint8_t*)(image + ofs) = val )
+#else
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
 	#define MINIRV32_STORE1( ofs, val ) *(uint8_t*)(image + ofs) = val
+#endif
 	#define MINIRV32_LOAD4( ofs ) *(uint32_t*)(image + ofs)
 	#define MINIRV32_LOAD2( ofs ) *(uint16_t*)(image + ofs)
 	#define MINIRV32_LOAD1( ofs ) *(uint8_t*)(image + ofs)
@@ -68,6 +85,11 @@
 	#define MINIRV32_LOAD1_SIGNED( ofs ) *(int8_t*)(image + ofs)
 #endif
 
+// A custom MINIRV32_STORE1/2/4 can use this to make MiniRV32IMAStep return 0
+// once the instruction doing the store is finished, i.e. to cut a time slice
+// short.  Native code from MINIRV32_JIT doesn't go through those hooks.
+#define MINIRV32_STEP_END() ( stepend = 1 )
+
 // As a note: We quouple-ify these, because in HLSL, we will be operating with
 // uint4's.  We are going to uint4 data to/from system RAM.
 //
@@ -106,6 +128,196 @@ struct MiniRV32IMAState
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
 #endif
 
+#ifdef MINIRV32_DIRTY_PAGES
+
+// Optional dirty page tracking.  Every store to RAM through the default memory
+// bus sets the bit for its 4kB page in MINIRV32_DIRTY_BITMAP, bit n of word
+// n/32 for page n.  The host can clear it, and later write out just the pages
+// that changed since, or count them to see how much memory the guest is really
+// using.  Anything the host writes to RAM itself isn't tracked.
+
+#define MINIRV32_DIRTY_PAGE_SHIFT 12
+#define MINIRV32_DIRTY_WORDS ( 0x80000000 >> ( MINIRV32_DIRTY_PAGE_SHIFT + 5 ) ) // Enough for 2GB of RAM.
+#define MINIRV32_IS_DIRTY( bitmap, page ) ( ( (bitmap)[(page)>>5] >> ( (page) & 31 ) ) & 1 )
+
+// Counts the dirty pages among pages 0 to pages-1.
+MINIRV32_DECORATE uint32_t MiniRV32IMACountDirtyPages( const uint32_t * bitmap, uint32_t pages );
+
+// Marks pages 0 to pages-1 clean, or dirty.
+MINIRV32_DECORATE void MiniRV32IMASetDirtyPages( uint32_t * bitmap, uint32_t pages, int dirty );
+
+#endif
+
+#ifdef MINIRV32_PAGE_ATTRS
+
+// Optional page attribute table for stores, one byte for each 4kB page of
+// addresses relative to MINIRV32_RAM_IMAGE_OFFSET, all 4GB of them.  A store
+// that stays within a page marked just MINIRV32_PAGE_RAM goes straight to RAM:
+// no compare against MINI_RV32_RAM_SIZE, no MINIRV32_DIRTY_PAGES marking and
+// no MINIRV32_PREDECODE invalidation.  Anything else (MMIO, faults, the first
+// store to a page, stores near decoded code) goes the usual way, which updates
+// the table.  Loads still use the compare, it's cheaper than a lookup.
+//
+// MINIRV32_PAGE_ATTR_TABLE must point at MINIRV32_PAGE_ATTR_ENTRIES zeroed
+// bytes.  Call MiniRV32IMAResetPageAttrs() before running, and again whenever
+// the host marks pages clean.  Native code from MINIRV32_JIT does its own
+// checks and doesn't use the table.
+
+#define MINIRV32_PAGE_ATTR_SHIFT 12
+#define MINIRV32_PAGE_ATTR_ENTRIES ( 1 << ( 32 - MINIRV32_PAGE_ATTR_SHIFT ) )
+#define MINIRV32_PAGE_RAM   1 // All RAM.  Stores only skip the checks if this is all that's set.
+#define MINIRV32_PAGE_CLEAN 2 // Might not be marked dirty yet.
+#define MINIRV32_PAGE_CODE  4 // Might hold decoded code.
+
+// Marks the pages of ramsize bytes of RAM as RAM, clean and maybe holding code.
+MINIRV32_DECORATE void MiniRV32IMAResetPageAttrs( uint8_t * attrs, uint32_t ramsize );
+
+#endif
+
+#if ( defined( MINIRV32_JIT ) || defined( MINIRV32_FUSE ) || defined( MINIRV32_PAIR_HISTOGRAM ) ) && !defined( MINIRV32_BLOCKCACHE )
+	#define MINIRV32_BLOCKCACHE
+#endif
+
+#if defined( MINIRV32_BLOCKCACHE ) && !defined( MINIRV32_PREDECODE )
+	#define MINIRV32_PREDECODE
+#endif
+
+#if defined( MINIRV32_PAGE_ATTRS ) && !defined( MINIRV32_DIRTY_PAGES ) && !defined( MINIRV32_PREDECODE )
+	// With nothing else to skip, the lookup costs more than the compare it replaces.
+	#error MINIRV32_PAGE_ATTRS needs MINIRV32_DIRTY_PAGES or MINIRV32_PREDECODE.
+#endif
+
+#ifdef MINIRV32_PREDECODE
+
+// Optional predecoded instruction cache.  Instructions are decoded once into
+// a handler index with their register numbers and sign-extended immediate,
+// and kept in a direct-mapped table keyed by guest physical PC.  Anything not
+// listed here (CSRs, SYSTEM, RV32A, FENCE.I, faults) falls back to the plain
+// interpreter.  Entries are dropped on stores into pages that hold decoded
+// code, and the whole cache is dropped on FENCE.I.
+//
+// With MINIRV32_BLOCKCACHE, the cache instead holds straight-line basic
+// blocks of decoded instructions, each ending at a jump, branch or an
+// instruction that needs the interpreter.  Blocks remember their successors,
+// so hot loops go from block to block without looking anything up, and the
+// instruction budget is only checked between blocks.
+//
+// MINIRV32_FUSE makes the block cache merge common pairs (LUI+ADDI,
+// AUIPC+ADDI/LW/JALR, SLT+BEQZ/BNEZ) into one handler.  Both instructions
+// still count towards cycle and the budget, and a pair that would fault is
+// left to run one instruction at a time.
+//
+// MINIRV32_PAIR_HISTOGRAM counts which handler follows which, see
+// MiniRV32IMAPrintPairHistogram.
+//
+// MINIRV32_JIT additionally compiles hot blocks to native code, on x86-64
+// only.  See mini-rv32ima-jit.h.
+
+#ifndef MINIRV32_PREDECODE_SIZE
+	#define MINIRV32_PREDECODE_SIZE 65536 // Entries, must be a power of two.
+#endif
+
+#ifndef MINIRV32_PREDECODE_PAGES
+	#define MINIRV32_PREDECODE_PAGES 65536 // Code page filter bits, must be a power of two.
+#endif
+
+#ifndef MINIRV32_PREDECODE_PAGE_SHIFT
+	#define MINIRV32_PREDECODE_PAGE_SHIFT 8 // Small "pages", so nearby data stores don't drop code.
+#endif
+
+#ifndef MINIRV32_BLOCKCACHE_SIZE
+	#define MINIRV32_BLOCKCACHE_SIZE 8192 // Blocks, must be a power of two.
+#endif
+
+#ifndef MINIRV32_BLOCK_MAX
+	#define MINIRV32_BLOCK_MAX 16 // Most instructions per block.
+#endif
+
+#ifndef MINIRV32_JIT_THRESHOLD
+	#define MINIRV32_JIT_THRESHOLD 32 // Times a block runs before it gets compiled.
+#endif
+
+#ifndef MINIRV32_JIT_SIZE
+	#define MINIRV32_JIT_SIZE (16*1024*1024) // Bytes of native code, all of it is thrown away when full.
+#endif
+
+#define MINIRV32_JIT_BLOCK_BYTES ( MINIRV32_BLOCK_MAX * 128 + 160 ) // Worst case per block.
+
+enum MiniRV32IMAOpcode
+{
+	MINIRV32_OP_INTERPRET = 0, // Not predecoded, use the plain interpreter.
+	MINIRV32_OP_LUI, MINIRV32_OP_AUIPC, MINIRV32_OP_JAL, MINIRV32_OP_JALR,
+	MINIRV32_OP_BEQ, MINIRV32_OP_BNE, MINIRV32_OP_BLT, MINIRV32_OP_BGE, MINIRV32_OP_BLTU, MINIRV32_OP_BGEU,
+	MINIRV32_OP_LB, MINIRV32_OP_LH, MINIRV32_OP_LW, MINIRV32_OP_LBU, MINIRV32_OP_LHU,
+	MINIRV32_OP_SB, MINIRV32_OP_SH, MINIRV32_OP_SW,
+	MINIRV32_OP_ADDI, MINIRV32_OP_SLTI, MINIRV32_OP_SLTIU, MINIRV32_OP_XORI, MINIRV32_OP_ORI, MINIRV32_OP_ANDI,
+	MINIRV32_OP_SLLI, MINIRV32_OP_SRLI, MINIRV32_OP_SRAI,
+	MINIRV32_OP_ADD, MINIRV32_OP_SUB, MINIRV32_OP_SLL, MINIRV32_OP_SLT, MINIRV32_OP_SLTU, MINIRV32_OP_XOR,
+	MINIRV32_OP_SRL, MINIRV32_OP_SRA, MINIRV32_OP_OR, MINIRV32_OP_AND,
+	MINIRV32_OP_MUL, MINIRV32_OP_MULH, MINIRV32_OP_MULHSU, MINIRV32_OP_MULHU,
+	MINIRV32_OP_DIV, MINIRV32_OP_DIVU, MINIRV32_OP_REM, MINIRV32_OP_REMU,
+	MINIRV32_OP_FENCE,
+	// Fused pairs, the second instruction is always the next entry in the block.
+	MINIRV32_OP_LUI_ADDI, MINIRV32_OP_AUIPC_ADDI, MINIRV32_OP_AUIPC_LW, MINIRV32_OP_AUIPC_JALR,
+	MINIRV32_OP_SLT_BRANCH, MINIRV32_OP_SLTU_BRANCH, MINIRV32_OP_SLTI_BRANCH, MINIRV32_OP_SLTIU_BRANCH,
+	MINIRV32_OP_COUNT,
+};
+
+struct MiniRV32IMADecodedInsn
+{
+	uint32_t tag; // pc | 1, so a zeroed entry is never valid.
+	uint32_t ir;
+	int32_t imm;
+	uint8_t op;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+};
+
+// Runs a compiled block, returns how many instructions it did and sets pc to the next one.
+typedef uint32_t (*MiniRV32IMANativeBlock)( uint32_t * regs, uint8_t * image, uint32_t * pc );
+
+struct MiniRV32IMABlock
+{
+	uint32_t tag; // Starting pc | 1.
+	uint32_t gen; // Code page generation this was translated under.
+	uint32_t len;
+	uint32_t page;
+	struct MiniRV32IMABlock * next[2]; // Chained successors, [0] is the fall-through.
+#ifdef MINIRV32_JIT
+	MiniRV32IMANativeBlock native;
+	uint32_t hits;
+#endif
+	struct MiniRV32IMADecodedInsn insn[MINIRV32_BLOCK_MAX];
+};
+
+struct MiniRV32IMADecodeCache
+{
+#ifdef MINIRV32_BLOCKCACHE
+	struct MiniRV32IMABlock blocks[MINIRV32_BLOCKCACHE_SIZE];
+	uint32_t pagegen[MINIRV32_PREDECODE_PAGES];
+	uint32_t epoch; // Bumped on FENCE.I, invalidates every block.
+#ifdef MINIRV32_JIT
+	uint8_t * jitbuf;
+	uint32_t jitused;
+#endif
+#else
+	struct MiniRV32IMADecodedInsn insn[MINIRV32_PREDECODE_SIZE];
+#endif
+	uint8_t codepages[MINIRV32_PREDECODE_PAGES/8];
+};
+
+// Must be called if the host rewrites guest code behind the processor's back, i.e. on reset.
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * cache );
+
+#ifdef MINIRV32_PAIR_HISTOGRAM
+// Prints the most common pairs of handlers with MINIRV32WARN.  Instructions
+// run by the interpreter show up as "interp".
+MINIRV32_DECORATE void MiniRV32IMAPrintPairHistogram( int top );
+#endif
+
+#endif
+
 #ifdef MINIRV32_IMPLEMENTATION
 
 #ifndef MINIRV32_CUSTOM_INTERNALS
@@ -115,8 +327,994 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 #define REGSET( x, val ) { state->regs[x] = val; }
 #endif
 
+#ifdef MINIRV32_DIRTY_PAGES
+
+#ifndef MINIRV32_DIRTY_BITMAP
+	static uint32_t MiniRV32IMADefaultDirtyBitmap[MINIRV32_DIRTY_WORDS];
+	#define MINIRV32_DIRTY_BITMAP MiniRV32IMADefaultDirtyBitmap
+#endif
+
+static inline void MiniRV32IMAMarkDirty( uint32_t * bitmap, uint32_t ofs, uint32_t len )
+{
+	uint32_t page = ofs >> MINIRV32_DIRTY_PAGE_SHIFT;
+	bitmap[page>>5] |= 1u<<(page&31);
+	// Misaligned stores can straddle two pages.
+	page = ( ofs + len - 1 ) >> MINIRV32_DIRTY_PAGE_SHIFT;
+	bitmap[page>>5] |= 1u<<(page&31);
+}
+
+MINIRV32_DECORATE uint32_t MiniRV32IMACountDirtyPages( const uint32_t * bitmap, uint32_t pages )
+{
+	uint32_t page, count = 0;
+	for( page = 0; page < pages; page++ )
+		count += MINIRV32_IS_DIRTY( bitmap, page );
+	return count;
+}
+
+MINIRV32_DECORATE void MiniRV32IMASetDirtyPages( uint32_t * bitmap, uint32_t pages, int dirty )
+{
+	uint32_t page;
+	for( page = 0; page < pages; page++ )
+	{
+		if( dirty )
+			bitmap[page>>5] |= 1u<<(page&31);
+		else
+			bitmap[page>>5] &= ~(1u<<(page&31));
+	}
+}
+
+#endif
+
+#ifdef MINIRV32_PREDECODE
+
+#ifndef MINIRV32_DECODE_CACHE
+	static struct MiniRV32IMADecodeCache MiniRV32IMADefaultDecodeCache;
+	#define MINIRV32_DECODE_CACHE (&MiniRV32IMADefaultDecodeCache)
+#endif
+
+#define MINIRV32_CODEPAGE( ofs ) ( ( (ofs) >> MINIRV32_PREDECODE_PAGE_SHIFT ) & ( MINIRV32_PREDECODE_PAGES - 1 ) )
+
+#endif
+
+#ifdef MINIRV32_PAGE_ATTRS
+
+#ifndef MINIRV32_PAGE_ATTR_TABLE
+	static uint8_t MiniRV32IMADefaultPageAttrs[MINIRV32_PAGE_ATTR_ENTRIES];
+	#define MINIRV32_PAGE_ATTR_TABLE MiniRV32IMADefaultPageAttrs
+#endif
+
+// Nonzero if a store of up to 4 bytes at ofs can go straight to RAM.
+#define MINIRV32_PAGE_STORE_OK( ofs ) ( MINIRV32_PAGE_ATTR_TABLE[(ofs) >> MINIRV32_PAGE_ATTR_SHIFT] == MINIRV32_PAGE_RAM && \
+	( (ofs) & ( ( 1 << MINIRV32_PAGE_ATTR_SHIFT ) - 1 ) ) <= ( 1 << MINIRV32_PAGE_ATTR_SHIFT ) - 4 )
+
+MINIRV32_DECORATE void MiniRV32IMAResetPageAttrs( uint8_t * attrs, uint32_t ramsize )
+{
+	uint32_t page, pages = ramsize >> MINIRV32_PAGE_ATTR_SHIFT;
+	uint8_t attr = MINIRV32_PAGE_RAM;
+#ifdef MINIRV32_DIRTY_PAGES
+	attr |= MINIRV32_PAGE_CLEAN;
+#endif
+#ifdef MINIRV32_PREDECODE
+	attr |= MINIRV32_PAGE_CODE; // Until the first store looks.
+#endif
+	for( page = 0; page < pages; page++ )
+		attrs[page] = attr;
+	// A partial page at the end stays 0, like everything past it.
+}
+
+// After a store of len bytes at ofs took the usual way.  Marks it dirty, and
+// lets the next stores to these pages skip the checks if they don't hold
+// decoded code.
+static inline void MiniRV32IMAPageStored( uint8_t * attrs, uint32_t ofs, uint32_t len )
+{
+	uint32_t page = ofs >> MINIRV32_PAGE_ATTR_SHIFT;
+	uint32_t last = ( ofs + len - 1 ) >> MINIRV32_PAGE_ATTR_SHIFT;
+#ifdef MINIRV32_DIRTY_PAGES
+	MiniRV32IMAMarkDirty( MINIRV32_DIRTY_BITMAP, ofs, len );
+#endif
+	for( ; page <= last; page++ )
+	{
+		uint8_t attr = attrs[page];
+		if( !( attr & ~MINIRV32_PAGE_RAM ) ) continue; // Not RAM, or nothing to clear.
+		attr = MINIRV32_PAGE_RAM;
+#ifdef MINIRV32_PREDECODE
+		uint32_t cofs;
+		for( cofs = 0; cofs < ( 1 << MINIRV32_PAGE_ATTR_SHIFT ); cofs += 1 << MINIRV32_PREDECODE_PAGE_SHIFT )
+		{
+			uint32_t cp = MINIRV32_CODEPAGE( ( page << MINIRV32_PAGE_ATTR_SHIFT ) + cofs );
+			if( ( MINIRV32_DECODE_CACHE->codepages[cp>>3] >> (cp&7) ) & 1 )
+			{
+				attr |= MINIRV32_PAGE_CODE;
+				break;
+			}
+		}
+#endif
+		attrs[page] = attr;
+	}
+}
+
+#define MINIRV32_PAGE_STORED( ofs, len ) MiniRV32IMAPageStored( MINIRV32_PAGE_ATTR_TABLE, ofs, len )
+
+#else
+#define MINIRV32_PAGE_STORE_OK( ofs ) 0
+#define MINIRV32_PAGE_STORED( ofs, len )
+#endif
+
+#ifdef MINIRV32_PREDECODE
+
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * cache )
+{
+#ifdef MINIRV32_JIT
+	uint8_t * jitbuf = cache->jitbuf; // Native code buffer is kept, but emptied.
+#endif
+	// Avoiding memset, so we don't depend on libc.
+	uint32_t * p = (uint32_t*)cache;
+	uint32_t * e = (uint32_t*)(cache + 1);
+	while( p != e ) *(p++) = 0;
+#ifdef MINIRV32_JIT
+	cache->jitbuf = jitbuf;
+#endif
+}
+
+// Called after every RAM store of len bytes, ofs is relative to
+// MINIRV32_RAM_IMAGE_OFFSET.  Returns nonzero if the store landed in a page
+// holding decoded code.
+static inline uint32_t MiniRV32IMAInvalidateCode( struct MiniRV32IMADecodeCache * cache, uint32_t ofs, uint32_t len )
+{
+	// Misaligned stores can straddle two pages.
+	uint32_t cp = MINIRV32_CODEPAGE( ofs );
+	uint32_t cpe = MINIRV32_CODEPAGE( ofs + len - 1 );
+	uint32_t hit = ( cache->codepages[cp>>3] >> (cp&7) ) & 1;
+	uint32_t hite = ( cache->codepages[cpe>>3] >> (cpe&7) ) & 1;
+	if( !hit && !hite ) return 0;
+#ifdef MINIRV32_BLOCKCACHE
+	// Drop every block on these pages, they get retranslated on next use.
+	if( hit )
+	{
+		cache->codepages[cp>>3] &= ~(1<<(cp&7));
+		cache->pagegen[cp]++;
+	}
+	if( hite && cpe != cp )
+	{
+		cache->codepages[cpe>>3] &= ~(1<<(cpe&7));
+		cache->pagegen[cpe]++;
+	}
+#else
+	// A store can touch at most two instruction words.
+	uint32_t iofs = ofs & ~3;
+	struct MiniRV32IMADecodedInsn * d = &cache->insn[(iofs>>2) & (MINIRV32_PREDECODE_SIZE-1)];
+	if( d->tag == ((iofs + MINIRV32_RAM_IMAGE_OFFSET) | 1) ) d->tag = 0;
+	d = &cache->insn[((iofs>>2)+1) & (MINIRV32_PREDECODE_SIZE-1)];
+	if( d->tag == ((iofs + 4 + MINIRV32_RAM_IMAGE_OFFSET) | 1) ) d->tag = 0;
+#endif
+	return 1;
+}
+
+static inline void MiniRV32IMAFenceI( struct MiniRV32IMADecodeCache * cache )
+{
+#ifdef MINIRV32_BLOCKCACHE
+	cache->epoch++;
+#else
+	MiniRV32IMAFlushDecodeCache( cache );
+#endif
+}
+
+static void MiniRV32IMADecode( struct MiniRV32IMADecodeCache * cache, struct MiniRV32IMADecodedInsn * d, uint32_t pc, uint32_t ir )
+{
+	uint32_t cp = MINIRV32_CODEPAGE( pc - MINIRV32_RAM_IMAGE_OFFSET );
+	cache->codepages[cp>>3] |= 1<<(cp&7);
+#ifdef MINIRV32_PAGE_ATTRS
+	if( MINIRV32_PAGE_ATTR_TABLE[( pc - MINIRV32_RAM_IMAGE_OFFSET ) >> MINIRV32_PAGE_ATTR_SHIFT] )
+		MINIRV32_PAGE_ATTR_TABLE[( pc - MINIRV32_RAM_IMAGE_OFFSET ) >> MINIRV32_PAGE_ATTR_SHIFT] |= MINIRV32_PAGE_CODE;
+#endif
+
+	uint32_t funct3 = ( ir >> 12 ) & 0x7;
+	int32_t imm = ir >> 20;
+	if( imm & 0x800 ) imm |= 0xfffff000; // Sign extension of I-type immediate.
+	uint32_t op = MINIRV32_OP_INTERPRET;
+
+	d->tag = pc | 1;
+	d->ir = ir;
+	d->rd = ( ir >> 7 ) & 0x1f;
+	d->rs1 = ( ir >> 15 ) & 0x1f;
+	d->rs2 = ( ir >> 20 ) & 0x1f;
+
+	switch( ir & 0x7f )
+	{
+		case 0x37: // LUI
+			op = MINIRV32_OP_LUI;
+			imm = ir & 0xfffff000;
+			break;
+		case 0x17: // AUIPC
+			op = MINIRV32_OP_AUIPC;
+			imm = ir & 0xfffff000;
+			break;
+		case 0x6F: // JAL
+			op = MINIRV32_OP_JAL;
+			imm = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( imm & 0x00100000 ) imm |= 0xffe00000;
+			break;
+		case 0x67: // JALR
+			op = MINIRV32_OP_JALR;
+			break;
+		case 0x63: // Branch
+		{
+			static const uint8_t branchops[8] = { MINIRV32_OP_BEQ, MINIRV32_OP_BNE, 0, 0, MINIRV32_OP_BLT, MINIRV32_OP_BGE, MINIRV32_OP_BLTU, MINIRV32_OP_BGEU };
+			op = branchops[funct3];
+			imm = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( imm & 0x1000 ) imm |= 0xffffe000;
+			d->rd = 0;
+			break;
+		}
+		case 0x03: // Load
+		{
+			static const uint8_t loadops[8] = { MINIRV32_OP_LB, MINIRV32_OP_LH, MINIRV32_OP_LW, 0, MINIRV32_OP_LBU, MINIRV32_OP_LHU, 0, 0 };
+			op = loadops[funct3];
+			break;
+		}
+		case 0x23: // Store
+		{
+			static const uint8_t storeops[8] = { MINIRV32_OP_SB, MINIRV32_OP_SH, MINIRV32_OP_SW, 0, 0, 0, 0, 0 };
+			op = storeops[funct3];
+			imm = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( imm & 0x800 ) imm |= 0xfffff000;
+			d->rd = 0;
+			break;
+		}
+		case 0x13: // Op-immediate
+		{
+			static const uint8_t immops[8] = { MINIRV32_OP_ADDI, MINIRV32_OP_SLLI, MINIRV32_OP_SLTI, MINIRV32_OP_SLTIU, MINIRV32_OP_XORI, MINIRV32_OP_SRLI, MINIRV32_OP_ORI, MINIRV32_OP_ANDI };
+			op = immops[funct3];
+			if( funct3 == 5 && ( ir & 0x40000000 ) ) op = MINIRV32_OP_SRAI;
+			if( funct3 == 1 || funct3 == 5 ) imm &= 0x1f;
+			break;
+		}
+		case 0x33: // Op
+		{
+			static const uint8_t regops[8] = { MINIRV32_OP_ADD, MINIRV32_OP_SLL, MINIRV32_OP_SLT, MINIRV32_OP_SLTU, MINIRV32_OP_XOR, MINIRV32_OP_SRL, MINIRV32_OP_OR, MINIRV32_OP_AND };
+			if( ir & 0x02000000 )
+				op = MINIRV32_OP_MUL + funct3; // RV32M is laid out in funct3 order.
+			else
+			{
+				op = regops[funct3];
+				if( ( ir & 0x40000000 ) && funct3 == 0 ) op = MINIRV32_OP_SUB;
+				if( ( ir & 0x40000000 ) && funct3 == 5 ) op = MINIRV32_OP_SRA;
+			}
+			break;
+		}
+		case 0x0f:
+			if( funct3 == 0 ) op = MINIRV32_OP_FENCE; // FENCE.I must go through the interpreter to flush.
+			break;
+	}
+
+	d->op = op;
+	d->imm = imm;
+}
+
+#ifdef MINIRV32_FUSE
+// First instruction of each fused pair, for anything that doesn't fuse.
+static const uint8_t MiniRV32IMAFusedFirst[] = {
+	MINIRV32_OP_LUI, MINIRV32_OP_AUIPC, MINIRV32_OP_AUIPC, MINIRV32_OP_AUIPC,
+	MINIRV32_OP_SLT, MINIRV32_OP_SLTU, MINIRV32_OP_SLTI, MINIRV32_OP_SLTIU };
+
+// Returns the fused op for d and the instruction after it, or d->op if they don't pair up.
+static uint32_t MiniRV32IMAFuse( const struct MiniRV32IMADecodedInsn * d )
+{
+	const struct MiniRV32IMADecodedInsn * n = d + 1;
+	uint32_t r = d->rd;
+	if( r == 0 ) return d->op;
+	switch( d->op )
+	{
+		case MINIRV32_OP_LUI:
+			if( n->op == MINIRV32_OP_ADDI && n->rs1 == r ) return MINIRV32_OP_LUI_ADDI;
+			break;
+		case MINIRV32_OP_AUIPC:
+			if( n->rs1 != r ) break;
+			if( n->op == MINIRV32_OP_ADDI ) return MINIRV32_OP_AUIPC_ADDI;
+			if( n->op == MINIRV32_OP_LW ) return MINIRV32_OP_AUIPC_LW;
+			if( n->op == MINIRV32_OP_JALR ) return MINIRV32_OP_AUIPC_JALR;
+			break;
+		case MINIRV32_OP_SLT: case MINIRV32_OP_SLTU: case MINIRV32_OP_SLTI: case MINIRV32_OP_SLTIU:
+			// Only a branch on the result being zero or not.
+			if( ( n->op == MINIRV32_OP_BEQ || n->op == MINIRV32_OP_BNE ) &&
+				( ( n->rs1 == r && n->rs2 == 0 ) || ( n->rs1 == 0 && n->rs2 == r ) ) )
+			{
+				static const uint8_t cmpbranch[4] = { MINIRV32_OP_SLT_BRANCH, MINIRV32_OP_SLTU_BRANCH, MINIRV32_OP_SLTI_BRANCH, MINIRV32_OP_SLTIU_BRANCH };
+				return cmpbranch[ ( d->op == MINIRV32_OP_SLT ) ? 0 : ( d->op == MINIRV32_OP_SLTU ) ? 1 : ( d->op == MINIRV32_OP_SLTI ) ? 2 : 3 ];
+			}
+			break;
+	}
+	return d->op;
+}
+#endif
+
+#ifdef MINIRV32_PAIR_HISTOGRAM
+static uint32_t MiniRV32IMAPairCounts[MINIRV32_OP_COUNT][MINIRV32_OP_COUNT];
+static uint32_t MiniRV32IMALastOp;
+#define MINIRV32_PAIR_COUNT( op ) { MiniRV32IMAPairCounts[MiniRV32IMALastOp][op]++; MiniRV32IMALastOp = (op); }
+
+MINIRV32_DECORATE void MiniRV32IMAPrintPairHistogram( int top )
+{
+	static const char * const names[MINIRV32_OP_COUNT] = {
+		"interp", "lui", "auipc", "jal", "jalr", "beq", "bne", "blt", "bge", "bltu", "bgeu",
+		"lb", "lh", "lw", "lbu", "lhu", "sb", "sh", "sw",
+		"addi", "slti", "sltiu", "xori", "ori", "andi", "slli", "srli", "srai",
+		"add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and",
+		"mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu", "fence",
+		"lui+addi", "auipc+addi", "auipc+lw", "auipc+jalr", "slt+b", "sltu+b", "slti+b", "sltiu+b" };
+	uint64_t total = 0;
+	int a, b;
+	for( a = 0; a < MINIRV32_OP_COUNT; a++ )
+		for( b = 0; b < MINIRV32_OP_COUNT; b++ )
+			total += MiniRV32IMAPairCounts[a][b];
+	MINIRV32WARN( "Handler pairs, %llu total:\n", (unsigned long long)total );
+
+	// Picks the largest remaining pair each time, so don't ask for too many.
+	uint32_t last = 0xffffffff;
+	int lasta = -1, lastb = -1;
+	for( ; top > 0; top-- )
+	{
+		int ba = -1, bb = -1;
+		uint32_t best = 0;
+		for( a = 0; a < MINIRV32_OP_COUNT; a++ )
+			for( b = 0; b < MINIRV32_OP_COUNT; b++ )
+			{
+				uint32_t c = MiniRV32IMAPairCounts[a][b];
+				// Same order as ( count descending, a, b ), strictly after the last one printed.
+				if( c > last || ( c == last && ( a < lasta || ( a == lasta && b <= lastb ) ) ) ) continue;
+				if( c > best || ( c == best && ba < 0 ) ) { best = c; ba = a; bb = b; }
+			}
+		if( ba < 0 || !best ) break;
+		MINIRV32WARN( "%12u %5.2f%% %s, %s\n", best, best * 100.0 / total, names[ba], names[bb] );
+		last = best; lasta = ba; lastb = bb;
+	}
+}
+#else
+#define MINIRV32_PAIR_COUNT( op )
+#endif
+
+// Executes one predecoded instruction.  Returns 0 if it must be redone by the
+// plain interpreter (without anything having changed), 2 if it stored into a
+// page holding decoded code and 1 otherwise, with 8 ORed in if the store hook
+// used MINIRV32_STEP_END().  Like the interpreter, jumps leave pc 4 short of
+// the target.
+//
+// Fused pairs write the first instruction's register themselves, return the
+// second one's result and pc, and OR 4 into the return value.
+static inline uint32_t MiniRV32IMAExecDecoded( struct MiniRV32IMAState * state, uint8_t * image, const struct MiniRV32IMADecodedInsn * d, uint32_t * pcp, uint32_t * rvalp, uint32_t ramlimit )
+{
+	uint32_t pc = *pcp;
+	uint32_t rval = 0;
+	switch( d->op )
+	{
+		case MINIRV32_OP_LUI: rval = d->imm; break;
+		case MINIRV32_OP_AUIPC: rval = pc + d->imm; break;
+		case MINIRV32_OP_JAL: rval = pc + 4; pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_JALR: rval = pc + 4; pc = ( (REG( d->rs1 ) + d->imm) & ~1) - 4; break;
+		case MINIRV32_OP_BEQ: if( REG( d->rs1 ) == REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_BNE: if( REG( d->rs1 ) != REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_BLT: if( (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_BGE: if( (int32_t)REG( d->rs1 ) >= (int32_t)REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_BLTU: if( REG( d->rs1 ) < REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_BGEU: if( REG( d->rs1 ) >= REG( d->rs2 ) ) pc = pc + d->imm - 4; break;
+		case MINIRV32_OP_LB: case MINIRV32_OP_LH: case MINIRV32_OP_LW: case MINIRV32_OP_LBU: case MINIRV32_OP_LHU:
+		{
+			uint32_t rsval = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET;
+			if( rsval >= ramlimit ) return 0; // MMIO or fault.
+			switch( d->op )
+			{
+				case MINIRV32_OP_LB: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
+				case MINIRV32_OP_LH: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
+				case MINIRV32_OP_LW: rval = MINIRV32_LOAD4( rsval ); break;
+				case MINIRV32_OP_LBU: rval = MINIRV32_LOAD1( rsval ); break;
+				default: rval = MINIRV32_LOAD2( rsval ); break;
+			}
+			break;
+		}
+		case MINIRV32_OP_SB: case MINIRV32_OP_SH: case MINIRV32_OP_SW:
+		{
+			uint32_t addy = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET;
+			uint32_t rs2 = REG( d->rs2 );
+			uint32_t stepend = 0;
+			uint32_t fast = MINIRV32_PAGE_STORE_OK( addy );
+			if( !fast && addy >= ramlimit ) return 0; // MMIO or fault.
+			switch( d->op )
+			{
+				case MINIRV32_OP_SB: MINIRV32_STORE1( addy, rs2 ); break;
+				case MINIRV32_OP_SH: MINIRV32_STORE2( addy, rs2 ); break;
+				default: MINIRV32_STORE4( addy, rs2 ); break;
+			}
+			uint32_t codehit = 0;
+			if( !fast )
+			{
+				uint32_t len = ( d->op == MINIRV32_OP_SB ) ? 1 : ( d->op == MINIRV32_OP_SH ) ? 2 : 4;
+				codehit = MiniRV32IMAInvalidateCode( MINIRV32_DECODE_CACHE, addy, len );
+				MINIRV32_PAGE_STORED( addy, len );
+			}
+			return ( 1 + codehit ) | ( stepend << 3 );
+		}
+		case MINIRV32_OP_ADDI: rval = REG( d->rs1 ) + d->imm; break;
+		case MINIRV32_OP_SLTI: rval = (int32_t)REG( d->rs1 ) < d->imm; break;
+		case MINIRV32_OP_SLTIU: rval = REG( d->rs1 ) < (uint32_t)d->imm; break;
+		case MINIRV32_OP_XORI: rval = REG( d->rs1 ) ^ d->imm; break;
+		case MINIRV32_OP_ORI: rval = REG( d->rs1 ) | d->imm; break;
+		case MINIRV32_OP_ANDI: rval = REG( d->rs1 ) & d->imm; break;
+		case MINIRV32_OP_SLLI: rval = REG( d->rs1 ) << d->imm; break;
+		case MINIRV32_OP_SRLI: rval = REG( d->rs1 ) >> d->imm; break;
+		case MINIRV32_OP_SRAI: rval = ((int32_t)REG( d->rs1 )) >> d->imm; break;
+		case MINIRV32_OP_ADD: rval = REG( d->rs1 ) + REG( d->rs2 ); break;
+		case MINIRV32_OP_SUB: rval = REG( d->rs1 ) - REG( d->rs2 ); break;
+		case MINIRV32_OP_SLL: rval = REG( d->rs1 ) << ( REG( d->rs2 ) & 0x1F ); break;
+		case MINIRV32_OP_SLT: rval = (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ); break;
+		case MINIRV32_OP_SLTU: rval = REG( d->rs1 ) < REG( d->rs2 ); break;
+		case MINIRV32_OP_XOR: rval = REG( d->rs1 ) ^ REG( d->rs2 ); break;
+		case MINIRV32_OP_SRL: rval = REG( d->rs1 ) >> ( REG( d->rs2 ) & 0x1F ); break;
+		case MINIRV32_OP_SRA: rval = ((int32_t)REG( d->rs1 )) >> ( REG( d->rs2 ) & 0x1F ); break;
+		case MINIRV32_OP_OR: rval = REG( d->rs1 ) | REG( d->rs2 ); break;
+		case MINIRV32_OP_AND: rval = REG( d->rs1 ) & REG( d->rs2 ); break;
+		case MINIRV32_OP_MUL: rval = REG( d->rs1 ) * REG( d->rs2 ); break;
+		case MINIRV32_OP_FENCE: break;
+#ifdef MINIRV32_FUSE
+		case MINIRV32_OP_LUI_ADDI:
+			REGSET( d->rd, d->imm );
+			rval = d->imm + d[1].imm;
+			pc += 4;
+			break;
+		case MINIRV32_OP_AUIPC_ADDI:
+			REGSET( d->rd, pc + d->imm );
+			rval = pc + d->imm + d[1].imm;
+			pc += 4;
+			break;
+		case MINIRV32_OP_AUIPC_LW:
+		{
+			uint32_t rsval = pc + d->imm + d[1].imm - MINIRV32_RAM_IMAGE_OFFSET;
+			if( rsval >= ramlimit ) return 0; // MMIO or fault, do them one by one.
+			REGSET( d->rd, pc + d->imm );
+			rval = MINIRV32_LOAD4( rsval );
+			pc += 4;
+			break;
+		}
+		case MINIRV32_OP_AUIPC_JALR:
+			REGSET( d->rd, pc + d->imm );
+			rval = pc + 8;
+			pc = ( ( pc + d->imm + d[1].imm ) & ~1 ) - 4;
+			break;
+		case MINIRV32_OP_SLT_BRANCH: case MINIRV32_OP_SLTU_BRANCH: case MINIRV32_OP_SLTI_BRANCH: case MINIRV32_OP_SLTIU_BRANCH:
+		{
+			uint32_t rs1 = REG( d->rs1 );
+			uint32_t rs2 = ( d->op >= MINIRV32_OP_SLTI_BRANCH ) ? (uint32_t)d->imm : REG( d->rs2 );
+			uint32_t lt = ( d->op == MINIRV32_OP_SLT_BRANCH || d->op == MINIRV32_OP_SLTI_BRANCH ) ? ( (int32_t)rs1 < (int32_t)rs2 ) : ( rs1 < rs2 );
+			REGSET( d->rd, lt );
+			pc += 4;
+			if( lt == ( d[1].op == MINIRV32_OP_BNE ) ) pc = pc + d[1].imm - 4;
+			break;
+		}
+#endif
+		default: return 0; // RV32M division and high multiplies, CSRs, SYSTEM, RV32A.
+	}
+	*pcp = pc;
+	*rvalp = rval;
+#ifdef MINIRV32_FUSE
+	if( d->op >= MINIRV32_OP_LUI_ADDI ) return 1 | 4;
+#endif
+	return 1;
+}
+
+#ifdef MINIRV32_BLOCKCACHE
+
+// Returns 0 if pc can't be fetched from, otherwise the (possibly empty) block starting at pc.
+static struct MiniRV32IMABlock * MiniRV32IMAFindBlock( struct MiniRV32IMADecodeCache * cache, uint8_t * image, uint32_t pc )
+{
+	uint32_t ofs = pc - MINIRV32_RAM_IMAGE_OFFSET;
+	if( ofs >= MINI_RV32_RAM_SIZE-3 || ( ofs & 3 ) ) return 0;
+
+	uint32_t cp = MINIRV32_CODEPAGE( ofs );
+	struct MiniRV32IMABlock * b = &cache->blocks[((ofs>>2) * 2654435761u >> 13) & (MINIRV32_BLOCKCACHE_SIZE-1)];
+	if( b->tag == ( pc | 1 ) && b->gen == cache->pagegen[cp] + cache->epoch ) return b;
+
+	b->tag = pc | 1;
+	b->gen = cache->pagegen[cp] + cache->epoch;
+	b->page = cp;
+	b->next[0] = b->next[1] = 0;
+#ifdef MINIRV32_JIT
+	b->native = 0;
+	b->hits = 0;
+#endif
+
+	int len = 0;
+	do
+	{
+		struct MiniRV32IMADecodedInsn * d = &b->insn[len];
+		MiniRV32IMADecode( cache, d, pc, MINIRV32_LOAD4( ofs ) );
+		if( d->op == MINIRV32_OP_INTERPRET ) break;
+		len++;
+		if( d->op >= MINIRV32_OP_JAL && d->op <= MINIRV32_OP_BGEU ) break;
+		pc += 4;
+		ofs += 4;
+	} while( len < MINIRV32_BLOCK_MAX && ( ofs & ((1<<MINIRV32_PREDECODE_PAGE_SHIFT)-1) ) && ofs < MINI_RV32_RAM_SIZE-3 );
+	b->len = len;
+#ifdef MINIRV32_FUSE
+	int i;
+	for( i = 0; i + 1 < len; i++ )
+	{
+		uint32_t op = MiniRV32IMAFuse( &b->insn[i] );
+		if( op == b->insn[i].op ) continue;
+		b->insn[i].op = op;
+		i++; // Don't let the second one start another pair.
+	}
+#endif
+	return b;
+}
+
+// Follows the chain from blk to the block at pc, linking them if they weren't already.
+static inline struct MiniRV32IMABlock * MiniRV32IMANextBlock( struct MiniRV32IMADecodeCache * cache, uint8_t * image, struct MiniRV32IMABlock * blk, uint32_t pc )
+{
+	int i;
+	for( i = 0; i < 2; i++ )
+	{
+		struct MiniRV32IMABlock * n = blk->next[i];
+		if( n && n->tag == ( pc | 1 ) && n->gen == cache->pagegen[n->page] + cache->epoch )
+			return n;
+	}
+	struct MiniRV32IMABlock * n = MiniRV32IMAFindBlock( cache, image, pc );
+	blk->next[ ( pc == ( blk->tag & ~1 ) + blk->len * 4 ) ? 0 : 1 ] = n;
+	return n;
+}
+
+#ifdef MINIRV32_JIT
+#include "mini-rv32ima-jit.h"
+#endif
+
+#endif
+
+#endif
+
+// Interpreter opcode handlers.  Each one does one major opcode, and returns
+// 0 to carry on, 1 if MiniRV32IMAStep should return x->ret right away, or 2 to
+// finish this instruction and then return x->ret.  Depending on
+// MINIRV32_DISPATCH they're reached through a switch, computed goto, or a
+// table of function pointers.  ramsize is MINI_RV32_RAM_SIZE.
+struct MiniRV32IMAExec
+{
+	uint32_t ir;
+	uint32_t pc;
+	uint32_t rval;
+	uint32_t rdid;
+	uint32_t trap;
+	uint32_t cycle;
+	int32_t ret;
+};
+
+#if MINIRV32_DISPATCH == MINIRV32_DISPATCH_CALL
+	#define MINIRV32_OPHANDLER static uint32_t
+#else
+	#define MINIRV32_OPHANDLER static inline uint32_t
+#endif
+
+// Everything the interpreter does, as ( major opcode, handler ).
+#define MINIRV32_OPCODES( X ) \
+	X( 0x37, LUI ) X( 0x17, AUIPC ) X( 0x6f, JAL ) X( 0x67, JALR ) X( 0x63, Branch ) X( 0x03, Load ) X( 0x23, Store ) \
+	X( 0x13, ALU ) X( 0x33, ALU ) X( 0x0f, Fence ) X( 0x73, System ) X( 0x2f, AMO )
+
+MINIRV32_OPHANDLER MiniRV32IMAOpIllegal( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	x->trap = (2+1); // Fault: Invalid opcode.
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpLUI( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	x->rval = ( x->ir & 0xfffff000 );
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpAUIPC( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	x->rval = x->pc + ( x->ir & 0xfffff000 );
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpJAL( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+	if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+	x->rval = x->pc + 4;
+	x->pc = x->pc + reladdy - 4;
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpJALR( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t imm = ir >> 20;
+	int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+	x->rval = x->pc + 4;
+	x->pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpBranch( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+	if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+	int32_t rs1 = REG((ir >> 15) & 0x1f);
+	int32_t rs2 = REG((ir >> 20) & 0x1f);
+	immm4 = x->pc + immm4 - 4;
+	x->rdid = 0;
+	switch( ( ir >> 12 ) & 0x7 )
+	{
+		// BEQ, BNE, BLT, BGE, BLTU, BGEU
+		case 0: if( rs1 == rs2 ) x->pc = immm4; break;
+		case 1: if( rs1 != rs2 ) x->pc = immm4; break;
+		case 4: if( rs1 < rs2 ) x->pc = immm4; break;
+		case 5: if( rs1 >= rs2 ) x->pc = immm4; break; //BGE
+		case 6: if( (uint32_t)rs1 < (uint32_t)rs2 ) x->pc = immm4; break;   //BLTU
+		case 7: if( (uint32_t)rs1 >= (uint32_t)rs2 ) x->pc = immm4; break;  //BGEU
+		default: x->trap = (2+1);
+	}
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpLoad( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t rs1 = REG((ir >> 15) & 0x1f);
+	uint32_t imm = ir >> 20;
+	int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+	uint32_t rsval = rs1 + imm_se;
+	uint32_t rval = 0;
+
+	rsval -= MINIRV32_RAM_IMAGE_OFFSET;
+	if( rsval >= ramsize-3 )
+	{
+		rsval += MINIRV32_RAM_IMAGE_OFFSET;
+		if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
+		{
+			MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+		}
+		else
+		{
+			x->trap = (5+1);
+			rval = rsval;
+		}
+	}
+	else
+	{
+		switch( ( ir >> 12 ) & 0x7 )
+		{
+			//LB, LH, LW, LBU, LHU
+			case 0: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
+			case 1: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
+			case 2: rval = MINIRV32_LOAD4( rsval ); break;
+			case 4: rval = MINIRV32_LOAD1( rsval ); break;
+			case 5: rval = MINIRV32_LOAD2( rsval ); break;
+			default: x->trap = (2+1);
+		}
+	}
+	x->rval = rval;
+	return 0;
+}
+
+// MINIRV32_HANDLE_MEM_STORE_CONTROL may "return" out of MiniRV32IMAStep, this
+// catches that so a handler can pass it on.
+static inline int64_t MiniRV32IMAStoreControl( struct MiniRV32IMAState * state, uint8_t * image, uint32_t addy, uint32_t rs2 )
+{
+	MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
+	return (int64_t)1 << 32;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpStore( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t rs1 = REG((ir >> 15) & 0x1f);
+	uint32_t rs2 = REG((ir >> 20) & 0x1f);
+	uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+	if( addy & 0x800 ) addy |= 0xfffff000;
+	addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
+	x->rdid = 0;
+
+	uint32_t fast = MINIRV32_PAGE_STORE_OK( addy );
+	if( !fast && addy >= ramsize-3 )
+	{
+		addy += MINIRV32_RAM_IMAGE_OFFSET;
+		if( MINIRV32_MMIO_RANGE( addy ) )
+		{
+			// The store still counts as done if the hook returns, so the host can
+			// use that to end a slice early.
+			int64_t ret = MiniRV32IMAStoreControl( state, image, addy, rs2 );
+			if( ret != (int64_t)1 << 32 )
+			{
+				x->ret = ret;
+				return 2;
+			}
+		}
+		else
+		{
+			x->trap = (7+1); // Store access fault.
+			x->rval = addy;
+		}
+	}
+	else
+	{
+		uint32_t stepend = 0;
+		switch( ( ir >> 12 ) & 0x7 )
+		{
+			//SB, SH, SW
+			case 0: MINIRV32_STORE1( addy, rs2 ); break;
+			case 1: MINIRV32_STORE2( addy, rs2 ); break;
+			case 2: MINIRV32_STORE4( addy, rs2 ); break;
+			default: x->trap = (2+1);
+		}
+		if( !fast && !x->trap )
+		{
+#ifdef MINIRV32_PREDECODE
+			MiniRV32IMAInvalidateCode( MINIRV32_DECODE_CACHE, addy, 1 << ( ( ir >> 12 ) & 0x7 ) );
+#endif
+			MINIRV32_PAGE_STORED( addy, 1 << ( ( ir >> 12 ) & 0x7 ) );
+		}
+		if( stepend )
+		{
+			x->ret = 0;
+			return 2;
+		}
+	}
+	return 0;
+}
+
+// Op-immediate 0b0010011 and Op 0b0110011
+MINIRV32_OPHANDLER MiniRV32IMAOpALU( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t imm = ir >> 20;
+	imm = imm | (( imm & 0x800 )?0xfffff000:0);
+	uint32_t rs1 = REG((ir >> 15) & 0x1f);
+	uint32_t is_reg = !!( ir & 0x20 );
+	uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
+	uint32_t rval = 0;
+
+	if( is_reg && ( ir & 0x02000000 ) )
+	{
+		switch( (ir>>12)&7 ) //0x02000000 = RV32M
+		{
+			case 0: rval = rs1 * rs2; break; // MUL
+#ifndef CUSTOM_MULH // If compiling on a system that doesn't natively, or via libgcc support 64-bit math.
+			case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
+			case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
+			case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
+#else
+			CUSTOM_MULH
+#endif
+			case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
+			case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
+			case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
+			case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
+		}
+	}
+	else
+	{
+		switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
+		{
+			case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break;
+			case 1: rval = rs1 << (rs2 & 0x1F); break;
+			case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
+			case 3: rval = rs1 < rs2; break;
+			case 4: rval = rs1 ^ rs2; break;
+			case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
+			case 6: rval = rs1 | rs2; break;
+			case 7: rval = rs1 & rs2; break;
+		}
+	}
+	x->rval = rval;
+	return 0;
+}
+
+MINIRV32_OPHANDLER MiniRV32IMAOpFence( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	x->rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
+#ifdef MINIRV32_PREDECODE
+	if( ( x->ir >> 12 ) & 1 ) MiniRV32IMAFenceI( MINIRV32_DECODE_CACHE );
+#endif
+	return 0;
+}
+
+// Zifencei+Zicsr  (0b1110011)
+MINIRV32_OPHANDLER MiniRV32IMAOpSystem( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t csrno = ir >> 20;
+	uint32_t microop = ( ir >> 12 ) & 0x7;
+	if( (microop & 3) ) // It's a Zicsr function.
+	{
+		int rs1imm = (ir >> 15) & 0x1f;
+		uint32_t rs1 = REG(rs1imm);
+		uint32_t writeval = rs1;
+		uint32_t rval = 0;
+
+		// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
+		// Generally, support for Zicsr
+		switch( csrno )
+		{
+		case 0x340: rval = CSR( mscratch ); break;
+		case 0x305: rval = CSR( mtvec ); break;
+		case 0x304: rval = CSR( mie ); break;
+		case 0xC00: rval = x->cycle; break;
+		case 0x344: rval = CSR( mip ); break;
+		case 0x341: rval = CSR( mepc ); break;
+		case 0x300: rval = CSR( mstatus ); break; //mstatus
+		case 0x342: rval = CSR( mcause ); break;
+		case 0x343: rval = CSR( mtval ); break;
+		case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
+		case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+		//case 0x3B0: rval = 0; break; //pmpaddr0
+		//case 0x3a0: rval = 0; break; //pmpcfg0
+		//case 0xf12: rval = 0x00000000; break; //marchid
+		//case 0xf13: rval = 0x00000000; break; //mimpid
+		//case 0xf14: rval = 0x00000000; break; //mhartid
+		default:
+			MINIRV32_OTHERCSR_READ( csrno, rval );
+			break;
+		}
+
+		switch( microop )
+		{
+			case 1: writeval = rs1; break;  			//CSRRW
+			case 2: writeval = rval | rs1; break;		//CSRRS
+			case 3: writeval = rval & ~rs1; break;		//CSRRC
+			case 5: writeval = rs1imm; break;			//CSRRWI
+			case 6: writeval = rval | rs1imm; break;	//CSRRSI
+			case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
+		}
+
+		switch( csrno )
+		{
+		case 0x340: SETCSR( mscratch, writeval ); break;
+		case 0x305: SETCSR( mtvec, writeval ); break;
+		case 0x304: SETCSR( mie, writeval ); break;
+		case 0x344: SETCSR( mip, writeval ); break;
+		case 0x341: SETCSR( mepc, writeval ); break;
+		case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+		case 0x342: SETCSR( mcause, writeval ); break;
+		case 0x343: SETCSR( mtval, writeval ); break;
+		//case 0x3a0: break; //pmpcfg0
+		//case 0x3B0: break; //pmpaddr0
+		//case 0xf11: break; //mvendorid
+		//case 0xf12: break; //marchid
+		//case 0xf13: break; //mimpid
+		//case 0xf14: break; //mhartid
+		//case 0x301: break; //misa
+		default:
+			MINIRV32_OTHERCSR_WRITE( csrno, writeval );
+			break;
+		}
+		x->rval = rval;
+	}
+	else if( microop == 0x0 ) // "SYSTEM" 0b000
+	{
+		x->rdid = 0;
+		if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
+		{
+			//https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
+			//Table 7.6. MRET then in mstatus/mstatush sets MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
+			// Should also update mstatus to reflect correct mode.
+			uint32_t startmstatus = CSR( mstatus );
+			uint32_t startextraflags = CSR( extraflags );
+			SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
+			SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
+			x->pc = CSR( mepc ) -4;
+		} else {
+			switch (csrno) {
+			case 0:
+				x->trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
+				break;
+			case 1:
+				x->trap = (3+1); break; // EBREAK 3 = "Breakpoint"
+			case 0x105: //WFI (Wait for interrupts)
+				CSR( mstatus ) |= 8;    //Enable interrupts
+				CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
+				SETCSR( pc, x->pc + 4 );
+				x->ret = 1;
+				return 1;
+			default:
+				x->trap = (2+1); break; // Illegal opcode.
+			}
+		}
+	}
+	else
+		x->trap = (2+1); 				// Note micrrop 0b100 == undefined.
+	return 0;
+}
+
+// RV32A (0b00101111)
+MINIRV32_OPHANDLER MiniRV32IMAOpAMO( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize )
+{
+	uint32_t ir = x->ir;
+	uint32_t rs1 = REG((ir >> 15) & 0x1f);
+	uint32_t rs2 = REG((ir >> 20) & 0x1f);
+	uint32_t irmid = ( ir>>27 ) & 0x1f;
+	uint32_t rval;
+
+	rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
+
+	// We don't implement load/store from UART or CLNT with RV32A here.
+
+	if( rs1 >= ramsize-3 )
+	{
+		x->trap = (7+1); //Store/AMO access fault
+		x->rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+	}
+	else
+	{
+		rval = MINIRV32_LOAD4( rs1 );
+
+		// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
+		uint32_t dowrite = 1;
+		switch( irmid )
+		{
+			case 2: //LR.W (0b00010)
+				dowrite = 0;
+				CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
+				break;
+			case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
+				rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
+				dowrite = !rval; // Only write if slot is valid.
+				break;
+			case 1: break; //AMOSWAP.W (0b00001)
+			case 0: rs2 += rval; break; //AMOADD.W (0b00000)
+			case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
+			case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
+			case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
+			case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
+			case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
+			case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
+			case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
+			default: x->trap = (2+1); dowrite = 0; break; //Not supported.
+		}
+		uint32_t stepend = 0;
+		if( dowrite )
+		{
+			MINIRV32_STORE4( rs1, rs2 );
+#ifdef MINIRV32_PREDECODE
+			MiniRV32IMAInvalidateCode( MINIRV32_DECODE_CACHE, rs1, 4 );
+#endif
+			MINIRV32_PAGE_STORED( rs1, 4 );
+		}
+		x->rval = rval;
+		if( stepend )
+		{
+			x->ret = 0;
+			return 2;
+		}
+	}
+	return 0;
+}
+
+#if MINIRV32_DISPATCH == MINIRV32_DISPATCH_CALL
+typedef uint32_t (*MiniRV32IMAOpHandler)( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAExec * x, uint32_t ramsize );
+
+// Indexed by ( ir >> 2 ) & 0x1f, for instructions where ( ir & 3 ) == 3.
+static const MiniRV32IMAOpHandler MiniRV32IMAOpTable[32] = {
+	MiniRV32IMAOpLoad, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpFence, // 0x03..0x0f
+	MiniRV32IMAOpALU, MiniRV32IMAOpAUIPC, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, // 0x13..0x1f
+	MiniRV32IMAOpStore, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpAMO, // 0x23..0x2f
+	MiniRV32IMAOpALU, MiniRV32IMAOpLUI, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, // 0x33..0x3f
+	MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, // 0x43..0x4f
+	MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, // 0x53..0x5f
+	MiniRV32IMAOpBranch, MiniRV32IMAOpJALR, MiniRV32IMAOpIllegal, MiniRV32IMAOpJAL, // 0x63..0x6f
+	MiniRV32IMAOpSystem, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, MiniRV32IMAOpIllegal, // 0x73..0x7f
+};
+#endif
+
 #ifndef MINIRV32_STEPPROTO
-MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
+// The body of MiniRV32IMAStep, with the RAM size as a parameter so that
+// MINIRV32_STEP_SPECIALIZE can make copies of it where it's a constant.  GCC
+// can't copy functions with computed gotos, so with MINIRV32_DISPATCH_GOTO they
+// all share one generic core.
+#if defined( __GNUC__ ) && MINIRV32_DISPATCH != MINIRV32_DISPATCH_GOTO
+__attribute__((always_inline))
+#endif
+static inline int32_t MiniRV32IMAStepCore( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, uint32_t ramsize )
 #else
 MINIRV32_STEPPROTO
 #endif
@@ -134,30 +1332,119 @@ MINIRV32_STEPPROTO
 	else
 		CSR( mip ) &= ~(1<<7);
 
+	// An external interrupt (MEIP) is raised by the host, and wakes us the same way.
+	if( CSR( mip ) & CSR( mie ) & (1<<11) )
+		CSR( extraflags ) &= ~4;
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
 
 	uint32_t trap = 0;
 	uint32_t rval = 0;
+	int32_t ret = 0;
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	// RAM accesses are checked against this one unsigned compare, anything
+	// else (MMIO, faults) goes the slow way.  MINI_RV32_RAM_SIZE is often a
+	// global, which the compiler would otherwise reload after every store, so
+	// the opcode handlers get it as a parameter too.  In the copies from
+	// MINIRV32_STEP_SPECIALIZE it's a constant.
+#ifdef MINIRV32_STEPPROTO
+	const uint32_t ramsize = MINI_RV32_RAM_SIZE;
+#endif
+	const uint32_t ramlimit = ramsize - 3;
+
+	if( ( CSR( mip ) & CSR( mie ) & ((1<<11) | (1<<7)) /*meie, mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
-		// Timer interrupt.
-		trap = 0x80000007;
+		// External interrupts go before the timer, like on real harts.
+		trap = ( CSR( mip ) & CSR( mie ) & (1<<11) ) ? 0x8000000b : 0x80000007;
 		pc -= 4;
 	}
-	else // No timer interrupt?  Execute a bunch of instructions.
+	else // No interrupt?  Execute a bunch of instructions.
 	for( int icount = 0; icount < count; icount++ )
 	{
+#ifdef MINIRV32_PREDECODE
+		// Run predecoded instructions for as long as we can, then fall through
+		// to let the interpreter do the one that stopped us.
+#ifdef MINIRV32_BLOCKCACHE
+		struct MiniRV32IMABlock * blk = MiniRV32IMAFindBlock( MINIRV32_DECODE_CACHE, image, pc );
+		while( blk && blk->len )
+		{
+#ifdef MINIRV32_JIT
+			if( blk->native && blk->len <= count - icount )
+			{
+				uint32_t done = blk->native( state->regs, image, &pc );
+				cycle += done;
+				icount += done;
+				if( done != blk->len || icount == count ) break;
+				blk = MiniRV32IMANextBlock( MINIRV32_DECODE_CACHE, image, blk, pc );
+				continue;
+			}
+			if( !blk->native && ++blk->hits == MINIRV32_JIT_THRESHOLD )
+				MiniRV32IMAJITCompile( MINIRV32_DECODE_CACHE, blk );
+#endif
+			const struct MiniRV32IMADecodedInsn * d = blk->insn;
+			const struct MiniRV32IMADecodedInsn * dend = d + ( ( blk->len < count - icount ) ? blk->len : ( count - icount ) );
+			uint32_t r = 0;
+			do
+			{
+#ifdef MINIRV32_FUSE
+				if( d->op >= MINIRV32_OP_LUI_ADDI && d + 1 == dend ) break; // Out of budget for both.
+#endif
+				r = MiniRV32IMAExecDecoded( state, image, d, &pc, &rval, ramlimit );
+				if( !r ) break;
+				MINIRV32_PAIR_COUNT( d->op );
+#ifdef MINIRV32_FUSE
+				if( r & 4 )
+				{
+					cycle++;
+					MINIRV32_POSTEXEC( ( blk->tag & ~1 ) + 4 * ( d - blk->insn ), d->ir, trap ); // pc may be past a jump already.
+					d++;
+				}
+#endif
+				cycle++;
+				if( d->rd ) REGSET( d->rd, rval );
+				MINIRV32_POSTEXEC( pc, d->ir, trap );
+				pc += 4;
+				d++;
+				if( r & 10 ) break; // We may have just overwritten this block, or been asked to stop.
+			} while( d != dend );
+			icount += d - blk->insn;
+			if( r & 8 ) count = icount;
+			if( d != dend || icount == count ) break;
+			blk = MiniRV32IMANextBlock( MINIRV32_DECODE_CACHE, image, blk, pc );
+		}
+#else
+		while( 1 )
+		{
+			uint32_t ofs = pc - MINIRV32_RAM_IMAGE_OFFSET;
+			if( ofs >= ramlimit || ( ofs & 3 ) ) break;
+			struct MiniRV32IMADecodedInsn * d = &MINIRV32_DECODE_CACHE->insn[(ofs>>2) & (MINIRV32_PREDECODE_SIZE-1)];
+			if( d->tag != ( pc | 1 ) )
+				MiniRV32IMADecode( MINIRV32_DECODE_CACHE, d, pc, MINIRV32_LOAD4( ofs ) );
+			uint32_t r = MiniRV32IMAExecDecoded( state, image, d, &pc, &rval, ramlimit );
+			if( !r ) break;
+			cycle++;
+			if( d->rd ) REGSET( d->rd, rval );
+			MINIRV32_POSTEXEC( pc, d->ir, trap );
+			pc += 4;
+			if( r & 8 ) count = icount + 1;
+			if( ++icount == count ) break;
+		}
+#endif
+		if( icount == count ) break;
+#endif
 		uint32_t ir = 0;
 		rval = 0;
 		cycle++;
+#ifdef MINIRV32_PAIR_HISTOGRAM
+		MINIRV32_PAIR_COUNT( MINIRV32_OP_INTERPRET );
+#endif
 		uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET;
 
-		if( ofs_pc >= MINI_RV32_RAM_SIZE )
+		if( ofs_pc >= ramlimit + 3 )
 		{
 			trap = 1 + 1;  // Handle access violation on instruction read.
 			break;
@@ -170,319 +1457,39 @@ MINIRV32_STEPPROTO
 		else
 		{
 			ir = MINIRV32_LOAD4( ofs_pc );
-			uint32_t rdid = (ir >> 7) & 0x1f;
+			struct MiniRV32IMAExec x = { ir, pc, 0, (ir >> 7) & 0x1f, 0, cycle, 0 };
+			uint32_t leave;
 
+#if MINIRV32_DISPATCH == MINIRV32_DISPATCH_CALL
+			if( ( ir & 3 ) == 3 )
+				leave = MiniRV32IMAOpTable[(ir >> 2) & 0x1f]( state, image, &x, ramsize );
+			else
+				leave = MiniRV32IMAOpIllegal( state, image, &x, ramsize );
+#elif MINIRV32_DISPATCH == MINIRV32_DISPATCH_GOTO
+			#define MINIRV32_GOTO_ENTRY( opcode, name ) [opcode] = &&op_##opcode,
+			#define MINIRV32_GOTO_LABEL( opcode, name ) op_##opcode: leave = MiniRV32IMAOp##name( state, image, &x, ramsize ); goto dispatched;
+			static const void * const dispatch[128] = { [0 ... 127] = &&op_illegal, MINIRV32_OPCODES( MINIRV32_GOTO_ENTRY ) };
+			goto *dispatch[ir & 0x7f];
+			MINIRV32_OPCODES( MINIRV32_GOTO_LABEL )
+			op_illegal: leave = MiniRV32IMAOpIllegal( state, image, &x, ramsize );
+			dispatched:
+#else
+			#define MINIRV32_SWITCH_CASE( opcode, name ) case opcode: leave = MiniRV32IMAOp##name( state, image, &x, ramsize ); break;
 			switch( ir & 0x7f )
 			{
-				case 0x37: // LUI (0b0110111)
-					rval = ( ir & 0xfffff000 );
-					break;
-				case 0x17: // AUIPC (0b0010111)
-					rval = pc + ( ir & 0xfffff000 );
-					break;
-				case 0x6F: // JAL (0b1101111)
-				{
-					int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
-					if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
-					rval = pc + 4;
-					pc = pc + reladdy - 4;
-					break;
-				}
-				case 0x67: // JALR (0b1100111)
-				{
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					rval = pc + 4;
-					pc = ( (REG( (ir >> 15) & 0x1f ) + imm_se) & ~1) - 4;
-					break;
-				}
-				case 0x63: // Branch (0b1100011)
-				{
-					uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
-					if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
-					int32_t rs1 = REG((ir >> 15) & 0x1f);
-					int32_t rs2 = REG((ir >> 20) & 0x1f);
-					immm4 = pc + immm4 - 4;
-					rdid = 0;
-					switch( ( ir >> 12 ) & 0x7 )
-					{
-						// BEQ, BNE, BLT, BGE, BLTU, BGEU
-						case 0: if( rs1 == rs2 ) pc = immm4; break;
-						case 1: if( rs1 != rs2 ) pc = immm4; break;
-						case 4: if( rs1 < rs2 ) pc = immm4; break;
-						case 5: if( rs1 >= rs2 ) pc = immm4; break; //BGE
-						case 6: if( (uint32_t)rs1 < (uint32_t)rs2 ) pc = immm4; break;   //BLTU
-						case 7: if( (uint32_t)rs1 >= (uint32_t)rs2 ) pc = immm4; break;  //BGEU
-						default: trap = (2+1);
-					}
-					break;
-				}
-				case 0x03: // Load (0b0000011)
-				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t imm = ir >> 20;
-					int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rsval = rs1 + imm_se;
-
-					rsval -= MINIRV32_RAM_IMAGE_OFFSET;
-					if( rsval >= MINI_RV32_RAM_SIZE-3 )
-					{
-						rsval += MINIRV32_RAM_IMAGE_OFFSET;
-						if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
-						{
-							MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
-						}
-						else
-						{
-							trap = (5+1);
-							rval = rsval;
-						}
-					}
-					else
-					{
-						switch( ( ir >> 12 ) & 0x7 )
-						{
-							//LB, LH, LW, LBU, LHU
-							case 0: rval = MINIRV32_LOAD1_SIGNED( rsval ); break;
-							case 1: rval = MINIRV32_LOAD2_SIGNED( rsval ); break;
-							case 2: rval = MINIRV32_LOAD4( rsval ); break;
-							case 4: rval = MINIRV32_LOAD1( rsval ); break;
-							case 5: rval = MINIRV32_LOAD2( rsval ); break;
-							default: trap = (2+1);
-						}
-					}
-					break;
-				}
-				case 0x23: // Store 0b0100011
-				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
-					uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
-					if( addy & 0x800 ) addy |= 0xfffff000;
-					addy += rs1 - MINIRV32_RAM_IMAGE_OFFSET;
-					rdid = 0;
-
-					if( addy >= MINI_RV32_RAM_SIZE-3 )
-					{
-						addy += MINIRV32_RAM_IMAGE_OFFSET;
-						if( MINIRV32_MMIO_RANGE( addy ) )
-						{
-							MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
-						}
-						else
-						{
-							trap = (7+1); // Store access fault.
-							rval = addy;
-						}
-					}
-					else
-					{
-						switch( ( ir >> 12 ) & 0x7 )
-						{
-							//SB, SH, SW
-							case 0: MINIRV32_STORE1( addy, rs2 ); break;
-							case 1: MINIRV32_STORE2( addy, rs2 ); break;
-							case 2: MINIRV32_STORE4( addy, rs2 ); break;
-							default: trap = (2+1);
-						}
-					}
-					break;
-				}
-				case 0x13: // Op-immediate 0b0010011
-				case 0x33: // Op           0b0110011
-				{
-					uint32_t imm = ir >> 20;
-					imm = imm | (( imm & 0x800 )?0xfffff000:0);
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t is_reg = !!( ir & 0x20 );
-					uint32_t rs2 = is_reg ? REG(imm & 0x1f) : imm;
-
-					if( is_reg && ( ir & 0x02000000 ) )
-					{
-						switch( (ir>>12)&7 ) //0x02000000 = RV32M
-						{
-							case 0: rval = rs1 * rs2; break; // MUL
-#ifndef CUSTOM_MULH // If compiling on a system that doesn't natively, or via libgcc support 64-bit math.
-							case 1: rval = ((int64_t)((int32_t)rs1) * (int64_t)((int32_t)rs2)) >> 32; break; // MULH
-							case 2: rval = ((int64_t)((int32_t)rs1) * (uint64_t)rs2) >> 32; break; // MULHSU
-							case 3: rval = ((uint64_t)rs1 * (uint64_t)rs2) >> 32; break; // MULHU
-#else
-							CUSTOM_MULH
-#endif
-							case 4: if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2); break; // DIV
-							case 5: if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2; break; // DIVU
-							case 6: if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2)); break; // REM
-							case 7: if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2; break; // REMU
-						}
-					}
-					else
-					{
-						switch( (ir>>12)&7 ) // These could be either op-immediate or op commands.  Be careful.
-						{
-							case 0: rval = (is_reg && (ir & 0x40000000) ) ? ( rs1 - rs2 ) : ( rs1 + rs2 ); break; 
-							case 1: rval = rs1 << (rs2 & 0x1F); break;
-							case 2: rval = (int32_t)rs1 < (int32_t)rs2; break;
-							case 3: rval = rs1 < rs2; break;
-							case 4: rval = rs1 ^ rs2; break;
-							case 5: rval = (ir & 0x40000000 ) ? ( ((int32_t)rs1) >> (rs2 & 0x1F) ) : ( rs1 >> (rs2 & 0x1F) ); break;
-							case 6: rval = rs1 | rs2; break;
-							case 7: rval = rs1 & rs2; break;
-						}
-					}
-					break;
-				}
-				case 0x0f: // 0b0001111
-					rdid = 0;   // fencetype = (ir >> 12) & 0b111; We ignore fences in this impl.
-					break;
-				case 0x73: // Zifencei+Zicsr  (0b1110011)
-				{
-					uint32_t csrno = ir >> 20;
-					uint32_t microop = ( ir >> 12 ) & 0x7;
-					if( (microop & 3) ) // It's a Zicsr function.
-					{
-						int rs1imm = (ir >> 15) & 0x1f;
-						uint32_t rs1 = REG(rs1imm);
-						uint32_t writeval = rs1;
-
-						// https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
-						// Generally, support for Zicsr
-						switch( csrno )
-						{
-						case 0x340: rval = CSR( mscratch ); break;
-						case 0x305: rval = CSR( mtvec ); break;
-						case 0x304: rval = CSR( mie ); break;
-						case 0xC00: rval = cycle; break;
-						case 0x344: rval = CSR( mip ); break;
-						case 0x341: rval = CSR( mepc ); break;
-						case 0x300: rval = CSR( mstatus ); break; //mstatus
-						case 0x342: rval = CSR( mcause ); break;
-						case 0x343: rval = CSR( mtval ); break;
-						case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
-						case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
-						//case 0x3B0: rval = 0; break; //pmpaddr0
-						//case 0x3a0: rval = 0; break; //pmpcfg0
-						//case 0xf12: rval = 0x00000000; break; //marchid
-						//case 0xf13: rval = 0x00000000; break; //mimpid
-						//case 0xf14: rval = 0x00000000; break; //mhartid
-						default:
-							MINIRV32_OTHERCSR_READ( csrno, rval );
-							break;
-						}
-
-						switch( microop )
-						{
-							case 1: writeval = rs1; break;  			//CSRRW
-							case 2: writeval = rval | rs1; break;		//CSRRS
-							case 3: writeval = rval & ~rs1; break;		//CSRRC
-							case 5: writeval = rs1imm; break;			//CSRRWI
-							case 6: writeval = rval | rs1imm; break;	//CSRRSI
-							case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
-						}
-
-						switch( csrno )
-						{
-						case 0x340: SETCSR( mscratch, writeval ); break;
-						case 0x305: SETCSR( mtvec, writeval ); break;
-						case 0x304: SETCSR( mie, writeval ); break;
-						case 0x344: SETCSR( mip, writeval ); break;
-						case 0x341: SETCSR( mepc, writeval ); break;
-						case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
-						case 0x342: SETCSR( mcause, writeval ); break;
-						case 0x343: SETCSR( mtval, writeval ); break;
-						//case 0x3a0: break; //pmpcfg0
-						//case 0x3B0: break; //pmpaddr0
-						//case 0xf11: break; //mvendorid
-						//case 0xf12: break; //marchid
-						//case 0xf13: break; //mimpid
-						//case 0xf14: break; //mhartid
-						//case 0x301: break; //misa
-						default:
-							MINIRV32_OTHERCSR_WRITE( csrno, writeval );
-							break;
-						}
-					}
-					else if( microop == 0x0 ) // "SYSTEM" 0b000
-					{
-						rdid = 0;
-						if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
-						{
-							//https://raw.githubusercontent.com/riscv/virtual-memory/main/specs/663-Svpbmt.pdf
-							//Table 7.6. MRET then in mstatus/mstatush sets MPV=0, MPP=0, MIE=MPIE, and MPIE=1. La
-							// Should also update mstatus to reflect correct mode.
-							uint32_t startmstatus = CSR( mstatus );
-							uint32_t startextraflags = CSR( extraflags );
-							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
-							SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
-							pc = CSR( mepc ) -4;
-						} else {
-							switch (csrno) {
-							case 0:
-								trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
-								break;
-							case 1:
-								trap = (3+1); break; // EBREAK 3 = "Breakpoint"
-							case 0x105: //WFI (Wait for interrupts)
-								CSR( mstatus ) |= 8;    //Enable interrupts
-								CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
-								SETCSR( pc, pc + 4 );
-								return 1;
-							default:
-								trap = (2+1); break; // Illegal opcode.
-							}
-						}
-					}
-					else
-						trap = (2+1); 				// Note micrrop 0b100 == undefined.
-					break;
-				}
-				case 0x2f: // RV32A (0b00101111)
-				{
-					uint32_t rs1 = REG((ir >> 15) & 0x1f);
-					uint32_t rs2 = REG((ir >> 20) & 0x1f);
-					uint32_t irmid = ( ir>>27 ) & 0x1f;
-
-					rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
-
-					// We don't implement load/store from UART or CLNT with RV32A here.
-
-					if( rs1 >= MINI_RV32_RAM_SIZE-3 )
-					{
-						trap = (7+1); //Store/AMO access fault
-						rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
-					}
-					else
-					{
-						rval = MINIRV32_LOAD4( rs1 );
-
-						// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
-						uint32_t dowrite = 1;
-						switch( irmid )
-						{
-							case 2: //LR.W (0b00010)
-								dowrite = 0;
-								CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
-								break;
-							case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
-								rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
-								dowrite = !rval; // Only write if slot is valid.
-								break;
-							case 1: break; //AMOSWAP.W (0b00001)
-							case 0: rs2 += rval; break; //AMOADD.W (0b00000)
-							case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
-							case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
-							case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
-							case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
-							case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
-							case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
-							case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
-							default: trap = (2+1); dowrite = 0; break; //Not supported.
-						}
-						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
-					}
-					break;
-				}
-				default: trap = (2+1); // Fault: Invalid opcode.
+				MINIRV32_OPCODES( MINIRV32_SWITCH_CASE )
+				default: leave = MiniRV32IMAOpIllegal( state, image, &x, ramsize ); break;
 			}
+#endif
+			if( leave == 1 ) return x.ret;
+			if( leave )
+			{
+				ret = x.ret;
+				count = icount + 1; // This is the last one.
+			}
+			pc = x.pc;
+			rval = x.rval;
+			trap = x.trap;
 
 			// If there was a trap, do NOT allow register writeback.
 			if( trap ) {
@@ -491,15 +1498,16 @@ MINIRV32_STEPPROTO
 				break;
 			}
 
-			if( rdid )
+			if( x.rdid )
 			{
-				REGSET( rdid, rval ); // Write back register.
+				REGSET( x.rdid, rval ); // Write back register.
 			}
 		}
 
 		MINIRV32_POSTEXEC( pc, ir, trap );
 
 		pc += 4;
+		if( ret ) break;
 	}
 
 	// Handle traps and interrupts.
@@ -532,9 +1540,24 @@ MINIRV32_STEPPROTO
 	if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
 	SETCSR( cyclel, cycle );
 	SETCSR( pc, pc );
-	return 0;
+	return ret;
 }
 
+#ifndef MINIRV32_STEPPROTO
+MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
+{
+	return MiniRV32IMAStepCore( state, image, vProcAddress, elapsedUs, count, MINI_RV32_RAM_SIZE );
+}
+
+// Defines name(), a MiniRV32IMAStep that only works with exactly ramsize bytes
+// of RAM, but can use it as a constant.  Hosts can make a few of these for
+// common sizes and pick one at startup.  MINIRV32_RAM_IMAGE_OFFSET,
+// MINIRV32_MMIO_RANGE and the hooks are macros, so they're constants already.
+#define MINIRV32_STEP_SPECIALIZE( name, ramsize ) \
+	MINIRV32_DECORATE int32_t name( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count ) \
+	{ return MiniRV32IMAStepCore( state, image, vProcAddress, elapsedUs, count, ramsize ); }
+#endif
+
 #endif
 
 #endif